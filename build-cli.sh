@@ -1,6 +1,23 @@
 mkdir -p bin/linux
 
-gcc -o bin/linux/harpoon -Wall -Wextra -DHARPOON_NO_MAIN_LOOP src/harpoon.c src/cli.c -lusb-1.0
+gcc -o bin/linux/harpoon -Wall -Wextra -DHARPOON_NO_MAIN_LOOP src/harpoon.c src/cli.c -lusb-1.0 -lm
 
-gcc -o bin/linux/harpoon-monitor -Wall -Wextra src/harpoon.c src/monitor.c -lusb-1.0
+gcc -o bin/linux/harpoon-monitor -Wall -Wextra src/harpoon.c src/monitor.c -lusb-1.0 -lm
+
+gcc -o bin/linux/harpoon-watch -Wall -Wextra src/harpoon.c src/watch.c -lusb-1.0 -lm
+
+gcc -o bin/linux/harpoon-bench -Wall -Wextra src/harpoon.c src/compositor.c src/idle.c src/bench.c src/bench-contexts.c src/bench-backends.c src/bench-lanes.c src/bench-layers.c src/bench-idle.c -lusb-1.0 -lm
+
+gcc -o bin/linux/harpoon-bench-allocs -Wall -Wextra src/harpoon.c src/bench-allocs.c -lusb-1.0 -lm
+
+gcc -o bin/linux/harpoon-load -Wall -Wextra src/harpoon.c src/load.c -lusb-1.0 -lm
+
+gcc -o bin/linux/harpoon-play -Wall -Wextra src/harpoon.c src/play.c -lusb-1.0 -lm
+
+gcc -o bin/linux/harpoon-sniper -Wall -Wextra src/harpoon.c src/idle.c src/sniper.c -lusb-1.0 -lm
+
+gcc -c -o bin/linux/harpoon.o -Wall -Wextra src/harpoon.c
+g++ -o bin/linux/harpoon-bench-async -std=c++20 -Wall -Wextra bin/linux/harpoon.o src/bench-async.cpp -lusb-1.0 -lm
+
+gcc -o bin/linux/libharpoon-emu.so -shared -fPIC -Wall -Wextra src/emulator.c -lpthread -ldl
 
@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# check-probes.sh <z64.me>
+#
+# checks that the built programs carry every USDT probe;
+# they are only compiled in if sys/sdt.h was found (the
+# systemtap-sdt-dev or systemtap-sdt-devel package)
+#
+#   sh scripts/check-probes.sh [programs...]
+#
+# checks everything build-cli.sh built when given no programs
+#
+
+PROBES="connect_start connect_done send_start send_done
+	disconnect_start disconnect_done monitor_start monitor_done
+	restart_start restart_done"
+
+if [ $# -eq 0 ]; then
+	set -- bin/linux/harpoon bin/linux/harpoon-*
+fi
+
+status=0
+for program in "$@"; do
+	if [ ! -f "$program" ]; then
+		echo "[!] $program: not found"
+		status=1
+		continue
+	fi
+	
+	found=$(readelf -n "$program" 2>/dev/null | awk '
+		/Provider:/ { provider = $2 }
+		/Name:/ && provider == "harpoon" { print $2 }
+	')
+	
+	missing=""
+	for probe in $PROBES; do
+		if ! echo "$found" | grep -qx "$probe"; then
+			missing="$missing $probe"
+		fi
+	done
+	
+	if [ -n "$missing" ]; then
+		echo "[!] $program: missing$missing"
+		status=1
+	else
+		echo "$program: ok"
+	fi
+done
+
+exit $status
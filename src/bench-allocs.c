@@ -0,0 +1,272 @@
+/*
+ * bench-allocs.c <z64.me>
+ *
+ * sends colors back to back four ways, and counts
+ * the CPU time and heap allocations each costs:
+ *   bulk     libusb_bulk_transfer(), as harpoon_send() did
+ *            before it had a pool of transfers
+ *   copied   harpoon_send(), which copies into the pool
+ *   inplace  harpoon_sendColor(), which encodes in the pool
+ *   usbfs    the latter through the usbfs backend
+ *
+ * allocations are told apart by who made them: harpoon,
+ * linked into this program, or libusb beneath it; under
+ * the emulator, the latter column counts the emulator's
+ * own bookkeeping instead, which stands in for libusb's
+ * per-submit URB (or, with usbfs, the kernel's), and is
+ * labeled as such
+ *
+ * malloc() and friends are wrapped to count, so this
+ * is a program of its own, and needs glibc:
+ *   HARPOON_EMU_LATENCY_US=0 LD_PRELOAD=bin/linux/libharpoon-emu.so \
+ *     bin/linux/harpoon-bench-allocs --packets 100000
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <libusb-1.0/libusb.h>
+
+#include "harpoon.h"
+
+#ifndef __GLIBC__
+#error "counting allocations needs glibc"
+#endif
+
+/* the mouse, opened directly for the "bulk" path the way harpoon.c opens it */
+#define BULK_VENDOR    0x1b1c
+#define BULK_PRODUCT   0x1b3c
+#define BULK_INTERFACE 1
+#define BULK_ENDPOINT  0x02
+
+/* each way a color has been sent, oldest first */
+enum path
+{
+	PATH_BULK = 0
+	, PATH_COPIED
+	, PATH_INPLACE
+	, PATH_USBFS
+};
+
+/* who asked for an allocation */
+enum owner
+{
+	OWNER_HARPOON = 0 /* code in this program, harpoon.c included */
+	, OWNER_BELOW     /* anything else; libusb, or the emulator */
+	, OWNER_COUNT
+};
+
+/* glibc's allocator, under the names that skip the wrappers below */
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+/* where this program's code lies, from the linker */
+extern char __executable_start[];
+extern char etext[];
+
+static atomic_ulong allocs[OWNER_COUNT];
+
+/*
+ *
+ * private
+ *
+ */
+
+static void count(const void *caller)
+{
+	bool own = (const char*)caller >= __executable_start
+		&& (const char*)caller < etext
+	;
+	
+	atomic_fetch_add_explicit(&allocs[own ? OWNER_HARPOON : OWNER_BELOW], 1, memory_order_relaxed);
+}
+
+/* fatal error message */
+static void die(const char *fmt, ...)
+{
+	va_list ap;
+	
+	if (!fmt)
+		exit(EXIT_FAILURE);
+		
+	fprintf(stderr, "[!] ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	
+	exit(EXIT_FAILURE);
+}
+
+static void showargs(void)
+{
+#define P(X) fprintf(stderr, X "\n")
+	P("  -n, --packets  colors to send each way (default 100000)");
+#undef P
+	exit(EXIT_FAILURE);
+}
+
+/* nanoseconds of CPU time used by this process */
+static uint64_t cpu_nsec(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* send 'n' colors back to back along 'path' */
+static void run(unsigned long n, enum path path)
+{
+	static const char *name[] = { "bulk", "copied", "inplace", "usbfs" };
+	libusb_context *ctx = 0;
+	libusb_device_handle *dev = 0;
+	struct harpoon *hp = 0;
+	const char *errstr;
+	unsigned long errors = 0;
+	unsigned long counted[OWNER_COUNT];
+	unsigned long i;
+	uint64_t cpu;
+	int k;
+	
+	if (path == PATH_BULK)
+	{
+		if (libusb_init(&ctx)
+			|| !(dev = libusb_open_device_with_vid_pid(ctx, BULK_VENDOR, BULK_PRODUCT))
+			|| libusb_set_auto_detach_kernel_driver(dev, true)
+			|| libusb_claim_interface(dev, BULK_INTERFACE)
+		)
+			die("%s: failed to open the mouse", name[path]);
+	}
+	else
+	{
+		hp = harpoon_new();
+		if (path == PATH_USBFS && harpoon_set_backend(hp, HARPOON_BACKEND_USBFS))
+		{
+			fprintf(stderr, "%-8s not supported here\n", name[path]);
+			harpoon_delete(hp);
+			return;
+		}
+		if ((errstr = harpoon_connect(hp)))
+			die("%s: %s", name[path], errstr);
+	}
+	
+	for (k = 0; k < OWNER_COUNT; ++k)
+		counted[k] = atomic_load(&allocs[k]);
+	cpu = cpu_nsec();
+	for (i = 0; i < n; ++i)
+	{
+		uint8_t v = i;
+		int sent = 0;
+		
+		if (path == PATH_BULK)
+			errors += libusb_bulk_transfer(dev, BULK_ENDPOINT | LIBUSB_ENDPOINT_OUT
+				, (void*)harpoonPacket_color(v, ~v, v ^ 0x55), HARPOON_PACKET_SIZE, &sent, 0
+			) || sent != HARPOON_PACKET_SIZE;
+		else if (path == PATH_COPIED)
+			errors += harpoon_send(hp, harpoonPacket_color(v, ~v, v ^ 0x55)) != 0;
+		else
+			errors += harpoon_sendColor(hp, v, ~v, v ^ 0x55) != 0;
+	}
+	cpu = cpu_nsec() - cpu;
+	for (k = 0; k < OWNER_COUNT; ++k)
+		counted[k] = atomic_load(&allocs[k]) - counted[k];
+		
+	fprintf(stderr, "%-8s %12.3f %12.2f %12.2f %8lu\n"
+		, name[path], cpu / 1000.0 / n
+		, (double)counted[OWNER_HARPOON] / n
+		, (double)counted[OWNER_BELOW] / n
+		, errors
+	);
+	
+	if (dev)
+	{
+		libusb_release_interface(dev, BULK_INTERFACE);
+		libusb_close(dev);
+	}
+	if (ctx)
+		libusb_exit(ctx);
+	if (hp)
+		harpoon_delete(hp);
+}
+
+/*
+ *
+ * public
+ *
+ */
+
+/* every heap allocation in the process passes through these */
+void *malloc(size_t size)
+{
+	count(__builtin_return_address(0));
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	count(__builtin_return_address(0));
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	count(__builtin_return_address(0));
+	return __libc_realloc(ptr, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	count(__builtin_return_address(0));
+	return __libc_memalign(alignment, size);
+}
+
+int main(int argc, char *argv[])
+{
+	const struct libusb_version *version = libusb_get_version();
+	bool emulated = version && version->describe && strstr(version->describe, "emulator");
+	unsigned long packets = 100000;
+	int i;
+	
+	/* step through arguments */
+	for (i = 1; i < argc; i += 2)
+	{
+#define ARGMATCH(ALIAS, NAME) (!strcasecmp(this, "-" ALIAS) \
+	|| !strcasecmp(this, "--" NAME))
+		const char *this = argv[i];
+		const char *param = argv[i + 1];
+		
+		if (!param)
+			showargs();
+			
+		if (ARGMATCH("n", "packets"))
+			packets = strtoul(param, 0, 0);
+		else
+			showargs();
+#undef ARGMATCH
+	}
+	if (!packets)
+		die("invalid arguments");
+		
+	fprintf(stderr, "%lu colors, allocations per packet by harpoon and by %s\n"
+		"%-8s %12s %12s %12s %8s\n"
+		, packets, emulated ? "the emulator standing in for libusb" : "libusb"
+		, "path", "CPU us/pkt", "harpoon", emulated ? "emulator" : "libusb", "errors"
+	);
+	run(packets, PATH_BULK);
+	run(packets, PATH_COPIED);
+	run(packets, PATH_INPLACE);
+	run(packets, PATH_USBFS);
+	
+	return 0;
+}
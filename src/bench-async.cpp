@@ -0,0 +1,170 @@
+/*
+ * bench-async.cpp <z64.me>
+ *
+ * many coroutines sending at once on a single
+ * thread, through harpoon.hpp; compared against
+ * the same packets sent one at a time
+ *
+ * to try it without a mouse plugged in:
+ *   LD_PRELOAD=bin/linux/libharpoon-emu.so bin/linux/harpoon-bench-async
+ *
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstdarg>
+#include <cstring>
+#include <strings.h>
+#include <time.h>
+#include <poll.h>
+
+#include "harpoon.hpp"
+
+#define MAX_POLLFDS 16
+
+struct counters
+{
+	unsigned running;   /* coroutines not yet finished */
+	unsigned inFlight;
+	unsigned maxInFlight;
+	unsigned long sent;
+	unsigned long errors;
+};
+
+/* fatal error message */
+static void die(const char *fmt, ...)
+{
+	va_list ap;
+	
+	if (!fmt)
+		exit(EXIT_FAILURE);
+		
+	fprintf(stderr, "[!] ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	
+	exit(EXIT_FAILURE);
+}
+
+static void showargs(void)
+{
+#define P(X) fprintf(stderr, X "\n")
+	P("  -c, --coroutines  how many send at once (default 64)");
+	P("  -n, --packets     packets each one sends (default 100)");
+#undef P
+	exit(EXIT_FAILURE);
+}
+
+/* seconds on the monotonic clock */
+static double now_sec(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static harpoonpp::Task sender(harpoonpp::Device &dev, counters &c, unsigned id, unsigned packets)
+{
+	unsigned i;
+	
+	for (i = 0; i < packets; ++i)
+	{
+		uint8_t v = id + i;
+		
+		c.inFlight += 1;
+		if (c.inFlight > c.maxInFlight)
+			c.maxInFlight = c.inFlight;
+		if (co_await dev.send(harpoonPacket_color(v, ~v, v ^ 0x55)))
+			c.errors += 1;
+		c.inFlight -= 1;
+		c.sent += 1;
+	}
+	
+	c.running -= 1;
+}
+
+int main(int argc, char *argv[])
+{
+	harpoonpp::Device dev;
+	counters c = {};
+	const char *errstr;
+	unsigned coroutines = 64;
+	unsigned packets = 100;
+	unsigned long total;
+	unsigned long i;
+	double start;
+	double async;
+	double blocking;
+	int k;
+	
+	/* step through arguments */
+	for (k = 1; k < argc; k += 2)
+	{
+#define ARGMATCH(ALIAS, NAME) (!strcasecmp(self, "-" ALIAS) \
+	|| !strcasecmp(self, "--" NAME))
+		const char *self = argv[k];
+		const char *param = argv[k + 1];
+		
+		if (!param)
+			showargs();
+			
+		if (ARGMATCH("c", "coroutines"))
+			coroutines = strtoul(param, 0, 0);
+		else if (ARGMATCH("n", "packets"))
+			packets = strtoul(param, 0, 0);
+		else
+			showargs();
+#undef ARGMATCH
+	}
+	if (!coroutines || !packets)
+		die("invalid arguments");
+	total = (unsigned long)coroutines * packets;
+	
+	if ((errstr = dev.connect()))
+		die("%s", errstr);
+		
+	/* everything is started up front; the loop below resumes them */
+	start = now_sec();
+	c.running = coroutines;
+	for (i = 0; i < coroutines; ++i)
+		sender(dev, c, i, packets);
+		
+	while (c.running)
+	{
+		struct pollfd fds[MAX_POLLFDS];
+		int n = dev.pollfds(fds, MAX_POLLFDS);
+		
+		if (n > MAX_POLLFDS)
+			n = MAX_POLLFDS;
+		poll(fds, n, dev.timeout());
+		dev.handle_events(0);
+		
+		if (!dev.isConnected())
+			die("mouse disconnected during the benchmark");
+	}
+	async = now_sec() - start;
+	
+	/* the same packets, one blocking send at a time */
+	start = now_sec();
+	for (i = 0; i < total; ++i)
+	{
+		uint8_t v = i;
+		
+		harpoon_send(dev.get(), harpoonPacket_color(v, ~v, v ^ 0x55));
+	}
+	blocking = now_sec() - start;
+	
+	fprintf(stderr, "%lu packets, %u coroutines on one thread\n", total, coroutines);
+	fprintf(stderr, "  async:    %8.3f s  %10.1f packets/s  max %u awaiting, %lu errors\n"
+		, async, total / async, c.maxInFlight, c.errors
+	);
+	fprintf(stderr, "  blocking: %8.3f s  %10.1f packets/s\n"
+		, blocking, total / blocking
+	);
+	
+	return 0;
+}
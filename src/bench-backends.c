@@ -0,0 +1,93 @@
+/*
+ * bench-backends.c <z64.me>
+ *
+ * harpoon-bench --backends sends packets one after another
+ * through libusb and then through usbfs, comparing the CPU time
+ * and latency of each; an emulated mouse with no latency of its
+ * own leaves only the host's share:
+ *   HARPOON_EMU_LATENCY_US=0 LD_PRELOAD=bin/linux/libharpoon-emu.so \
+ *     bin/linux/harpoon-bench --backends 100000
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "harpoon.h"
+#include "bench.h"
+
+/*
+ *
+ * private
+ *
+ */
+
+/* send 'n' packets back to back through 'backend' */
+static void run(unsigned long n, enum harpoonBackend backend, uint32_t *samples)
+{
+	const char *name = backend == HARPOON_BACKEND_USBFS ? "usbfs" : "libusb";
+	const char *errstr;
+	struct harpoon *hp;
+	unsigned long errors = 0;
+	unsigned long i;
+	uint64_t cpu;
+	uint64_t wall;
+	
+	hp = harpoon_new();
+	if (harpoon_set_backend(hp, backend))
+	{
+		fprintf(stderr, "%-8s not supported here\n", name);
+		harpoon_delete(hp);
+		return;
+	}
+	if ((errstr = harpoon_connect(hp)))
+		die("%s: %s", name, errstr);
+		
+	cpu = cpu_nsec();
+	wall = now_nsec();
+	for (i = 0; i < n; ++i)
+	{
+		uint64_t before = now_nsec();
+		uint8_t v = i;
+		
+		if (harpoon_send(hp, harpoonPacket_color(v, ~v, v ^ 0x55)))
+			errors += 1;
+		samples[i] = now_nsec() - before;
+	}
+	cpu = cpu_nsec() - cpu;
+	wall = now_nsec() - wall;
+	
+	qsort(samples, n, sizeof(*samples), compare_u32);
+	fprintf(stderr, "%-8s %12.3f %10.1f %10.1f %10.1f %8lu\n"
+		, name, cpu / 1000.0 / n, n / (wall / 1e9)
+		, percentile(samples, n, 0.50), percentile(samples, n, 0.99)
+		, errors
+	);
+	
+	harpoon_delete(hp);
+}
+
+/*
+ *
+ * public
+ *
+ */
+
+
+void bench_backends(const char *param)
+{
+	unsigned long n = strtoul(param, 0, 0);
+	uint32_t *samples;
+	
+	if (!n)
+		die("invalid arguments");
+	if (!(samples = malloc(sizeof(*samples) * n)))
+		die("memory error");
+		
+	fprintf(stderr, "%lu packets\n%-8s %12s %10s %10s %10s %8s\n"
+		, n, "backend", "CPU us/pkt", "packets/s", "p50 us", "p99 us", "errors"
+	);
+	run(n, HARPOON_BACKEND_LIBUSB, samples);
+	run(n, HARPOON_BACKEND_USBFS, samples);
+	free(samples);
+}
@@ -0,0 +1,122 @@
+/*
+ * bench-contexts.c <z64.me>
+ *
+ * harpoon-bench --contexts compares the cost of creating
+ * many handles on one shared libusb context against giving
+ * each handle its own
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <libusb-1.0/libusb.h>
+
+#include "harpoon.h"
+#include "bench.h"
+
+/*
+ *
+ * private
+ *
+ */
+
+/* resident memory in KiB, and open descriptors, of this process */
+static void measure_usage(long *kib, int *fds)
+{
+	FILE *fp;
+	DIR *dir;
+	long pages = 0;
+	
+	*kib = 0;
+	if ((fp = fopen("/proc/self/statm", "r")))
+	{
+		if (fscanf(fp, "%*s %ld", &pages) == 1)
+			*kib = pages * (sysconf(_SC_PAGESIZE) / 1024);
+		fclose(fp);
+	}
+	
+	*fds = 0;
+	if ((dir = opendir("/proc/self/fd")))
+	{
+		while (readdir(dir))
+			*fds += 1;
+		closedir(dir);
+	}
+}
+
+/* create and delete 'n' handles, in a child process so each
+ * variant starts from the same clean slate
+ */
+static void run(int n, bool shared)
+{
+	struct harpoon **hp;
+	libusb_context *ctx = 0;
+	uint64_t start;
+	double init;
+	double teardown;
+	long kib[2];
+	int fds[2];
+	int errcode;
+	int i;
+	pid_t pid;
+	
+	if ((pid = fork()) < 0)
+		die("fork failed");
+	if (pid)
+	{
+		waitpid(pid, 0, 0);
+		return;
+	}
+	
+	if (!(hp = calloc(n, sizeof(*hp))))
+		die("memory error");
+		
+	measure_usage(&kib[0], &fds[0]);
+	start = now_nsec();
+	if (shared && (errcode = libusb_init(&ctx)))
+		die("libusb_init failed: %s", libusb_error_name(errcode));
+	for (i = 0; i < n; ++i)
+		if ((errcode = harpoon_new_with_context(&hp[i], ctx)))
+			die("harpoon_new_with_context failed: %s", libusb_error_name(errcode));
+	init = (now_nsec() - start) / 1e6;
+	measure_usage(&kib[1], &fds[1]);
+	
+	start = now_nsec();
+	for (i = 0; i < n; ++i)
+		harpoon_delete(hp[i]);
+	if (ctx)
+		libusb_exit(ctx);
+	teardown = (now_nsec() - start) / 1e6;
+	
+	fprintf(stderr, "%-8s %10.3f %10.3f %10ld %8d\n"
+		, shared ? "shared" : "private"
+		, init, teardown, kib[1] - kib[0], fds[1] - fds[0]
+	);
+	
+	exit(EXIT_SUCCESS);
+}
+
+/*
+ *
+ * public
+ *
+ */
+
+
+void bench_contexts(const char *param)
+{
+	int n = strtol(param, 0, 0);
+	
+	if (n <= 0)
+		die("invalid arguments");
+		
+	/* no mouse needed for this one */
+	fprintf(stderr, "%d handles\n%-8s %10s %10s %10s %8s\n"
+		, n, "context", "init ms", "delete ms", "+KiB", "+fds"
+	);
+	run(n, true);
+	run(n, false);
+}
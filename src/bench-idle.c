@@ -0,0 +1,224 @@
+/*
+ * bench-idle.c <z64.me>
+ *
+ * harpoon-bench --idle runs a hue cycle at 200 frames per second
+ * that pauses once the user is idle, as the GUI's does, pressing a
+ * button through uinput for the first third of the time and once
+ * more near the end; it counts packets and wakeups per hour while
+ * active and while idle, and how soon the cycle resumed
+ *
+ * it needs write access to /dev/uinput, and read access to the
+ * /dev/input/event* node the button appears as; the numbers so
+ * far came from a FIFO standing in for that node, so the uinput
+ * part itself has yet to be run:
+ *   sudo LD_PRELOAD=bin/linux/libharpoon-emu.so \
+ *     bin/linux/harpoon-bench --idle 6000
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+
+#include "harpoon.h"
+#include "bench.h"
+
+/* the GUI's fastest hue cycle, and how often the button
+ * is pressed while the user is pretending to be there
+ */
+#define IDLE_FRAME_NSEC  5000000ull
+#define IDLE_INPUT_NSEC  100000000ull
+
+/*
+ *
+ * private
+ *
+ */
+
+/* a virtual device with only the key on it */
+static int test_create(unsigned key)
+{
+	struct uinput_setup setup = {0};
+	int fd;
+	
+	if ((fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+		die("failed to open /dev/uinput: %s", strerror(errno));
+		
+	setup.id.bustype = BUS_VIRTUAL;
+	snprintf(setup.name, sizeof(setup.name), "harpoon-bench test");
+	if (ioctl(fd, UI_SET_EVBIT, EV_KEY)
+		|| ioctl(fd, UI_SET_KEYBIT, key)
+		|| ioctl(fd, UI_DEV_SETUP, &setup)
+		|| ioctl(fd, UI_DEV_CREATE)
+	)
+		die("failed to create a uinput device: %s", strerror(errno));
+		
+	return fd;
+}
+
+static void test_emit(int fd, unsigned key, int value)
+{
+	struct input_event ev[2] = {0};
+	
+	ev[0].type = EV_KEY;
+	ev[0].code = key;
+	ev[0].value = value;
+	ev[1].type = EV_SYN;
+	ev[1].code = SYN_REPORT;
+	if (write(fd, ev, sizeof(ev)) != sizeof(ev))
+		die("failed to write to the uinput device");
+}
+
+static void idle_print(const char *phase, uint64_t nsec, unsigned long packets, unsigned long wakeups)
+{
+	double hours = nsec / 3.6e12;
+	
+	fprintf(stderr, "%-8s %10.2f %14.0f %14.0f\n"
+		, phase, nsec / 1e9
+		, hours ? packets / hours : 0
+		, hours ? wakeups / hours : 0
+	);
+}
+
+/* run an idle-aware hue cycle for 'msec'; the user goes idle
+ * halfway through, and comes back at five sixths
+ */
+static void run(unsigned msec)
+{
+	const char *errstr;
+	struct harpoonIdle *idle;
+	struct harpoon *hp;
+	unsigned long packets[2] = {0}; /* while running, and while paused */
+	unsigned long wakeups[2] = {0};
+	uint64_t start;
+	uint64_t inputEnd;
+	uint64_t comeBack;
+	uint64_t end;
+	uint64_t nextFrame;
+	uint64_t nextInput;
+	uint64_t pausedAt = 0;
+	uint64_t resumedAt = 0;
+	uint64_t pressedAt = 0;
+	bool paused = false;
+	uint8_t hue = 0;
+	int testFd;
+	
+	testFd = test_create(BTN_SIDE);
+	sleep_until(now_nsec() + 500 * 1000000ull); /* for udev to catch up */
+	if (!(idle = harpoonIdle_new(msec / 6)))
+		die("no input device can be read");
+	hp = harpoon_new();
+	if ((errstr = harpoon_connect(hp)))
+		die("%s", errstr);
+		
+	start = now_nsec();
+	inputEnd = start + msec * 1000000ull / 3;
+	comeBack = start + msec * 1000000ull * 5 / 6;
+	end = start + msec * 1000000ull;
+	nextFrame = start;
+	nextInput = start;
+	while (!resumedAt)
+	{
+		struct pollfd fds[1 + BENCH_MAX_POLLFDS];
+		uint64_t now = now_nsec();
+		uint64_t next = end;
+		int timeout = harpoon_get_timeout(hp);
+		int wait;
+		int nfds;
+		
+		/* a paused cycle only wakes up for input */
+		if (!paused && nextFrame < next)
+			next = nextFrame;
+		if (nextInput && nextInput < next)
+			next = nextInput;
+		wait = next > now ? (next - now + 999999) / 1000000 : 0;
+		if (timeout < 0 || wait < timeout)
+			timeout = wait;
+			
+		fds[0].fd = harpoonIdle_fd(idle);
+		fds[0].events = POLLIN;
+		nfds = harpoon_get_pollfds(hp, fds + 1, BENCH_MAX_POLLFDS);
+		poll(fds, 1 + (nfds < BENCH_MAX_POLLFDS ? nfds : BENCH_MAX_POLLFDS), timeout);
+		wakeups[paused] += 1;
+		harpoon_handle_events(hp, 0);
+		now = now_nsec();
+		if (now >= end)
+			break;
+			
+		/* the pretend user: busy, then away, then back once */
+		if (nextInput && now >= nextInput)
+		{
+			test_emit(testFd, BTN_SIDE, 1);
+			test_emit(testFd, BTN_SIDE, 0);
+			if (now >= comeBack)
+			{
+				pressedAt = now;
+				nextInput = 0;
+			}
+			else if ((nextInput += IDLE_INPUT_NSEC) >= inputEnd)
+				nextInput = comeBack;
+		}
+		
+		/* as in the GUI: frames stop once idle, and the idle
+		 * descriptor brings them back on the next input
+		 */
+		if (paused)
+		{
+			if ((fds[0].revents & POLLIN) && !harpoonIdle_check(idle))
+				resumedAt = now;
+		}
+		else if (now >= nextFrame)
+		{
+			if (harpoonIdle_check(idle))
+			{
+				paused = true;
+				pausedAt = now;
+				continue;
+			}
+			
+			hue += 1;
+			if (!harpoon_sendColor(hp, hue, ~hue, hue ^ 0x55))
+				packets[paused] += 1;
+			nextFrame += IDLE_FRAME_NSEC;
+			if (nextFrame < now)
+				nextFrame = now;
+		}
+	}
+	
+	fprintf(stderr, "%-8s %10s %14s %14s\n", "phase", "seconds", "packets/hour", "wakeups/hour");
+	idle_print("active", (pausedAt ? pausedAt : end) - start, packets[0], wakeups[0]);
+	if (pausedAt)
+		idle_print("idle", (resumedAt ? resumedAt : end) - pausedAt, packets[1], wakeups[1]);
+	if (resumedAt)
+		fprintf(stderr, "resumed %.2f ms after input\n", (resumedAt - pressedAt) / 1e6);
+	else
+		fprintf(stderr, "[!] the cycle %s\n", pausedAt ? "did not resume" : "never paused");
+		
+	harpoon_delete(hp);
+	harpoonIdle_delete(idle);
+	ioctl(testFd, UI_DEV_DESTROY);
+	close(testFd);
+}
+
+/*
+ *
+ * public
+ *
+ */
+
+
+void bench_idle(const char *param)
+{
+	unsigned msec = strtoul(param, 0, 0);
+	
+	if (!msec)
+		die("invalid arguments");
+		
+	run(msec);
+}
@@ -0,0 +1,244 @@
+/*
+ * bench-lanes.c <z64.me>
+ *
+ * harpoon-bench --lanes streams colors at 200 frames per second
+ * and changes the DPI config every so often, timing how long each
+ * change takes to reach the mouse; first with harpoon_queue(), then
+ * with every packet sent in the order it was made; a mouse slower
+ * than the stream shows the difference best:
+ *   HARPOON_EMU_LATENCY_US=6000 LD_PRELOAD=bin/linux/libharpoon-emu.so \
+ *     bin/linux/harpoon-bench --lanes 5000
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+
+#include "harpoon.h"
+#include "bench.h"
+
+/* the color stream, and how often the DPI config changes;
+ * the latter isn't a multiple of the former, so changes land
+ * everywhere between frames
+ */
+#define LANES_FRAME_NSEC  5000000ull  /* 200 fps */
+#define LANES_DPI_NSEC    97000000ull
+#define LANES_FIFO_MAX    4096
+
+/* without harpoon_queue(): packets in the order they were made */
+struct fifo
+{
+	struct harpoon *hp;
+	harpoonPacket data[LANES_FIFO_MAX][HARPOON_PACKET_SIZE];
+	bool isDpi[LANES_FIFO_MAX];
+	unsigned head;
+	unsigned count;
+	bool sending;
+	unsigned long dropped;
+	uint64_t dpiStart;     /* when the DPI change being timed was made */
+	uint32_t *samples;     /* its latency, in usec */
+	unsigned long n;
+};
+
+/*
+ *
+ * private
+ *
+ */
+
+static void fifo_pump(struct fifo *f);
+
+static void fifo_onDone(void *udata, int result)
+{
+	struct fifo *f = udata;
+	
+	if (f->isDpi[f->head] && f->dpiStart)
+	{
+		f->samples[f->n++] = (now_nsec() - f->dpiStart) / 1000;
+		f->dpiStart = 0;
+	}
+	
+	f->sending = false;
+	f->head = (f->head + 1) % LANES_FIFO_MAX;
+	f->count -= 1;
+	fifo_pump(f);
+	
+	(void)result;
+}
+
+static void fifo_pump(struct fifo *f)
+{
+	if (f->sending || !f->count)
+		return;
+		
+	/* with every transfer in use, the next completion retries */
+	if (!harpoon_sendAsync(f->hp, f->data[f->head], fifo_onDone, f))
+		f->sending = true;
+}
+
+static void fifo_push(struct fifo *f, const harpoonPacket *sig, bool isDpi)
+{
+	unsigned i = (f->head + f->count) % LANES_FIFO_MAX;
+	
+	if (f->count >= LANES_FIFO_MAX)
+	{
+		f->dropped += 1;
+		return;
+	}
+	
+	memcpy(f->data[i], sig, HARPOON_PACKET_SIZE);
+	f->isDpi[i] = isDpi;
+	f->count += 1;
+	fifo_pump(f);
+}
+
+/* stream colors for 'msec' while changing the DPI config, through
+ * the send lanes, or else through 'f' in the order packets are made
+ */
+static void run(unsigned msec, struct fifo *f, uint32_t *samples)
+{
+	const char *errstr;
+	struct harpoon *hp;
+	uint64_t start;
+	uint64_t end;
+	uint64_t nextFrame;
+	uint64_t nextDpi;
+	uint64_t dpiStart = 0;
+	unsigned long n = 0;
+	unsigned long frames = 0;
+	unsigned long changes = 0;
+	
+	hp = harpoon_new();
+	if ((errstr = harpoon_connect(hp)))
+		die("%s", errstr);
+	if (f)
+	{
+		memset(f, 0, sizeof(*f));
+		f->hp = hp;
+		f->samples = samples;
+	}
+	
+	start = now_nsec();
+	end = start + msec * 1000000ull;
+	nextFrame = start;
+	nextDpi = start + LANES_DPI_NSEC;
+	while (1)
+	{
+		struct pollfd fds[BENCH_MAX_POLLFDS];
+		uint64_t now = now_nsec();
+		uint64_t next = nextFrame < nextDpi ? nextFrame : nextDpi;
+		int timeout = harpoon_get_timeout(hp);
+		int wait = next > now ? (next - now + 999999) / 1000000 : 0;
+		int nfds;
+		
+		if (timeout < 0 || wait < timeout)
+			timeout = wait;
+		nfds = harpoon_get_pollfds(hp, fds, BENCH_MAX_POLLFDS);
+		poll(fds, nfds < BENCH_MAX_POLLFDS ? nfds : BENCH_MAX_POLLFDS, timeout);
+		harpoon_handle_events(hp, 0);
+		now = now_nsec();
+		
+		if (!harpoon_isConnected(hp))
+			die("mouse disconnected during the benchmark");
+			
+		/* the change is applied once the control lane has emptied */
+		if (!f && dpiStart && !harpoon_pending(hp, HARPOON_PRIORITY_CONTROL))
+		{
+			samples[n++] = (now - dpiStart) / 1000;
+			dpiStart = 0;
+		}
+		
+		if (now >= end)
+			break;
+			
+		if (now >= nextFrame)
+		{
+			uint8_t v = frames++;
+			const harpoonPacket *sig = harpoonPacket_color(v, ~v, v ^ 0x55);
+			
+			if (f)
+				fifo_push(f, sig, false);
+			else
+			{
+				harpoon_queue(hp, sig);
+				harpoon_flush(hp);
+			}
+			
+			/* a late frame is late, not an extra one */
+			nextFrame += LANES_FRAME_NSEC;
+			if (nextFrame < now)
+				nextFrame = now;
+		}
+		
+		/* only one change is timed at a time */
+		if (now >= nextDpi)
+		{
+			const harpoonPacket *sig = harpoonPacket_dpiconfig(0, 400 + (changes & 1) * 400, 400, 0, 0, 0);
+			
+			if (f && !f->dpiStart)
+			{
+				f->dpiStart = now;
+				fifo_push(f, sig, true);
+			}
+			else if (!f && !dpiStart)
+			{
+				dpiStart = now;
+				harpoon_queue(hp, sig);
+				harpoon_flush(hp);
+			}
+			changes += 1;
+			nextDpi += LANES_DPI_NSEC;
+		}
+	}
+	
+	/* cancelled sends aren't timed */
+	if (f)
+	{
+		n = f->n;
+		f->dpiStart = 0;
+	}
+	qsort(samples, n, sizeof(*samples), compare_u32);
+	
+	/* samples are in usec, so percentiles come out in msec */
+	fprintf(stderr, "%-8s %8lu %8lu %10.2f %10.2f %10.2f %8lu\n"
+		, f ? "fifo" : "lanes", frames, n
+		, percentile(samples, n, 0.50), percentile(samples, n, 0.99)
+		, n ? samples[n - 1] / 1000.0 : 0
+		, f ? f->dropped : 0
+	);
+	
+	harpoon_delete(hp);
+}
+
+/*
+ *
+ * public
+ *
+ */
+
+
+void bench_lanes(const char *param)
+{
+	unsigned msec = strtoul(param, 0, 0);
+	uint32_t *samples;
+	struct fifo *f;
+	
+	if (!msec)
+		die("invalid arguments");
+	if (!(samples = malloc(sizeof(*samples) * ((uint64_t)msec * 1000000 / LANES_DPI_NSEC + 1)))
+		|| !(f = malloc(sizeof(*f)))
+	)
+		die("memory error");
+		
+	fprintf(stderr, "%.0f fps colors, DPI change every %.0f ms, for %u ms\n"
+		"%-8s %8s %8s %10s %10s %10s %8s\n"
+		, 1e9 / LANES_FRAME_NSEC, LANES_DPI_NSEC / 1e6, msec
+		, "sched", "frames", "changes", "p50 ms", "p99 ms", "max ms", "dropped"
+	);
+	run(msec, 0, samples);
+	run(msec, f, samples);
+	free(samples);
+	free(f);
+}
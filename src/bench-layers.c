@@ -0,0 +1,158 @@
+/*
+ * bench-layers.c <z64.me>
+ *
+ * harpoon-bench --layers stacks that many compositor layers and
+ * times harpoonCompositor_update() with nothing changed, with one
+ * layer changing each time, and with short-lived layers expiring;
+ * the CPU time includes sending, so an emulated mouse with no
+ * latency of its own leaves mostly the compositor's share:
+ *   HARPOON_EMU_LATENCY_US=0 LD_PRELOAD=bin/linux/libharpoon-emu.so \
+ *     bin/linux/harpoon-bench --layers 32
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "harpoon.h"
+#include "bench.h"
+
+/* updates timed in each phase, and how long the expiring
+ * phase lasts; a quarter of the layers live 1 to 8 msec, and are
+ * set again as soon as they expire
+ */
+#define LAYERS_UPDATES     100000
+#define LAYER_COUNT_MAX    25 /* plus its expiring quarter, under the compositor's 32 */
+#define LAYERS_EXPIRE_MSEC 1000
+
+/*
+ *
+ * private
+ *
+ */
+
+/* color packets the compositor has sent; the color filter
+ * only counts them, as it skips nothing but exact repeats
+ */
+static unsigned long layers_sent(struct harpoon *hp)
+{
+	unsigned long sent;
+	
+	harpoon_get_colorFilterStats(hp, &sent, 0);
+	
+	return sent;
+}
+
+static void layers_print(const char *phase, unsigned long updates, uint64_t cpu, unsigned long packets)
+{
+	fprintf(stderr, "%-10s %10lu %12.1f %10lu\n"
+		, phase, updates, (double)cpu / updates, packets
+	);
+}
+
+/* time harpoonCompositor_update() over a stack of 'count' layers */
+static void run(int count)
+{
+	const char *errstr;
+	struct harpoonCompositor *c;
+	struct harpoon *hp;
+	uint64_t expiring[LAYER_COUNT_MAX];
+	unsigned long updates;
+	unsigned long sent;
+	uint64_t cpu;
+	uint64_t end;
+	int i;
+	
+	hp = harpoon_new();
+	if ((errstr = harpoon_connect(hp)))
+		die("%s", errstr);
+	if (!(c = harpoonCompositor_new(hp)))
+		die("memory error");
+	harpoon_set_colorFilter(hp, 1, 0);
+	
+	/* every blend mode, at half strength */
+	for (i = 0; i < count; ++i)
+		if (harpoonCompositor_set(c, i, i, 0x010101 * (i * 37 % 256), 128, i % 4, 0))
+			die("the compositor holds fewer than %d layers", count);
+	harpoonCompositor_update(c);
+	
+	/* dirty tracking: nothing to recompose */
+	sent = layers_sent(hp);
+	cpu = cpu_nsec();
+	for (i = 0; i < LAYERS_UPDATES; ++i)
+		harpoonCompositor_update(c);
+	layers_print("unchanged", LAYERS_UPDATES, cpu_nsec() - cpu, layers_sent(hp) - sent);
+	
+	/* an effect animating the topmost layer */
+	sent = layers_sent(hp);
+	cpu = cpu_nsec();
+	for (i = 0; i < LAYERS_UPDATES; ++i)
+	{
+		harpoonCompositor_set(c, count - 1, count - 1, (i * 0x10307u) & 0xffffff, 128, HARPOON_BLEND_NORMAL, 0);
+		harpoonCompositor_update(c);
+	}
+	layers_print("changing", LAYERS_UPDATES, cpu_nsec() - cpu, layers_sent(hp) - sent);
+	
+	/* notifications coming and going, driven by update's deadlines */
+	if (count < 4)
+	{
+		harpoonCompositor_delete(c);
+		harpoon_delete(hp);
+		return;
+	}
+	memset(expiring, 0, sizeof(expiring));
+	updates = 0;
+	sent = layers_sent(hp);
+	cpu = cpu_nsec();
+	end = now_nsec() + LAYERS_EXPIRE_MSEC * 1000000ull;
+	while (now_nsec() < end)
+	{
+		uint64_t now;
+		int wait;
+		
+		wait = harpoonCompositor_update(c);
+		updates += 1;
+		
+		/* layers that just expired come back, for the next update;
+		 * the compositor counts whole msec on the same clock
+		 */
+		now = now_nsec() / 1000000;
+		for (i = 0; i < count / 4; ++i)
+		{
+			if (expiring[i] > now)
+				continue;
+				
+			harpoonCompositor_set(c, count + i, i * 4 + 1, 0xffffff ^ (i * 0x10101), 255, HARPOON_BLEND_SCREEN, i % 8 + 1);
+			expiring[i] = now + i % 8 + 1;
+			wait = 0;
+		}
+		
+		if (wait > 0)
+			sleep_until(now_nsec() + wait * 1000000ull);
+	}
+	layers_print("expiring", updates, cpu_nsec() - cpu, layers_sent(hp) - sent);
+	
+	harpoonCompositor_delete(c);
+	harpoon_delete(hp);
+}
+
+/*
+ *
+ * public
+ *
+ */
+
+
+void bench_layers(const char *param)
+{
+	int count = strtol(param, 0, 0);
+	
+	if (count <= 0 || count > LAYER_COUNT_MAX)
+		die("invalid arguments");
+		
+	fprintf(stderr, "%d layers\n%-10s %10s %12s %10s\n"
+		, count, "phase", "updates", "CPU ns/upd", "packets"
+	);
+	run(count);
+}
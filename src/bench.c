@@ -0,0 +1,346 @@
+/*
+ * bench.c <z64.me>
+ *
+ * measures how many color packets per second
+ * the mouse sustains on this host, and how
+ * long each one takes to go through
+ *
+ * to try it without a mouse plugged in:
+ *   LD_PRELOAD=bin/linux/libharpoon-emu.so bin/linux/harpoon-bench
+ *
+ * the other benchmarks it runs instead, each picked
+ * by an option of its own, live in the bench-*.c
+ * files listed in the table below
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+
+#include "harpoon.h"
+#include "bench.h"
+
+/* a step is over its knee once it falls this far behind, or its
+ * median latency grows this many times past the lowest median of
+ * the steps before it; a step runs until it has at least this many
+ * samples, so a rate is never judged on a handful of packets
+ */
+#define KNEE_RATE_RATIO  0.95
+#define KNEE_P50_RATIO   2.0
+#define KNEE_MIN_SAMPLES 200
+
+struct step
+{
+	unsigned target;   /* packets per second requested */
+	double achieved;   /* packets per second delivered */
+	unsigned long count;
+	unsigned long errors;
+	double p50;        /* latencies in usec */
+	double p99;
+	double p999;
+};
+
+/* the benchmarks that run instead of the ramp */
+static const struct mode
+{
+	const char *alias;
+	const char *name;
+	const char *help;
+	void (*run)(const char *param);
+} modes[] = {
+	{ "-c", "--contexts", "time creating this many handles, shared vs private", bench_contexts }
+	, { "-b", "--backends", "send this many packets through libusb vs usbfs", bench_backends }
+	, { "-l", "--lanes", "time DPI changes under a color stream for this many msec", bench_lanes }
+	, { "-y", "--layers", "time the compositor with this many layers", bench_layers }
+	, { "-i", "--idle", "count idle packets and wakeups over this many msec (uinput)", bench_idle }
+};
+
+/* fatal error message */
+void die(const char *fmt, ...)
+{
+	va_list ap;
+	
+	if (!fmt)
+		exit(EXIT_FAILURE);
+		
+	fprintf(stderr, "[!] ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	
+	exit(EXIT_FAILURE);
+}
+
+static void showargs(void)
+{
+	int i;
+	
+#define P(X) fprintf(stderr, X "\n")
+	P("  -s, --start     first packet rate to try, per second (default 50)");
+	P("  -m, --max       give up ramping past this rate (default 4000)");
+	P("  -f, --factor    rate multiplier between steps (default 1.25)");
+	P("  -t, --time      milliseconds spent at each rate (default 1000)");
+	P("  -o, --output    JSON report file (default harpoon-bench.json)");
+#undef P
+	for (i = 0; i < (int)(sizeof(modes) / sizeof(*modes)); ++i)
+		fprintf(stderr, "  %s, %-11s instead, %s\n", modes[i].alias, modes[i].name, modes[i].help);
+	exit(EXIT_FAILURE);
+}
+
+/* nanoseconds on the monotonic clock */
+uint64_t now_nsec(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* nanoseconds of CPU time used by this process */
+uint64_t cpu_nsec(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void sleep_until(uint64_t nsec)
+{
+	struct timespec ts = { nsec / 1000000000, nsec % 1000000000 };
+	
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR)
+		;
+}
+
+int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	
+	return (x > y) - (x < y);
+}
+
+/* latency at percentile 'p' of 'n' sorted samples, in usec */
+double percentile(const uint32_t *sorted, unsigned long n, double p)
+{
+	unsigned long i;
+	
+	/* no samples, no latency; p * (n - 1) would wrap */
+	if (!n)
+		return 0;
+		
+	i = p * (n - 1) + 0.5;
+	
+	return sorted[i] / 1000.0;
+}
+
+/* send packets at 'step->target' per second for 'msec', or
+ * longer at low rates, until there are KNEE_MIN_SAMPLES
+ */
+static void run_step(struct harpoon *hp, struct step *step, unsigned msec, uint32_t *samples)
+{
+	uint64_t interval = 1000000000ull / step->target;
+	uint64_t start = now_nsec();
+	uint64_t end = start + msec * 1000000ull;
+	uint64_t next = start;
+	uint64_t last = start;
+	unsigned long n = 0;
+	
+	step->errors = 0;
+	
+	while (next < end || n < KNEE_MIN_SAMPLES)
+	{
+		uint64_t before;
+		uint8_t v = n;
+		
+		/* a slow transfer pushes the schedule back instead of bunching up */
+		sleep_until(next);
+		
+		before = now_nsec();
+		if (harpoon_send(hp, harpoonPacket_color(v, ~v, v ^ 0x55)))
+			step->errors += 1;
+		last = now_nsec();
+		samples[n++] = last - before;
+		
+		next += interval;
+		if (next < last)
+			next = last;
+	}
+	
+	/* a step that ran long for its samples is judged over all of it */
+	if (next > end)
+		end = next;
+		
+	qsort(samples, n, sizeof(*samples), compare_u32);
+	step->count = n;
+	step->achieved = n / (((last > end ? last : end) - start) / 1e9);
+	step->p50 = percentile(samples, n, 0.50);
+	step->p99 = percentile(samples, n, 0.99);
+	step->p999 = percentile(samples, n, 0.999);
+}
+
+static void write_report(const char *path, const struct step *steps, int count, int knee)
+{
+	FILE *fp;
+	int i;
+	
+	if (!(fp = fopen(path, "w")))
+		die("failed to open '%s' for writing", path);
+		
+	fprintf(fp, "{\n\t\"steps\": [\n");
+	for (i = 0; i < count; ++i)
+	{
+		const struct step *s = &steps[i];
+		
+		fprintf(fp
+			, "\t\t{ \"target_pps\": %u, \"achieved_pps\": %.1f, \"packets\": %lu"
+			  ", \"errors\": %lu, \"p50_us\": %.1f, \"p99_us\": %.1f, \"p999_us\": %.1f }%s\n"
+			, s->target, s->achieved, s->count
+			, s->errors, s->p50, s->p99, s->p999
+			, i + 1 < count ? "," : ""
+		);
+	}
+	fprintf(fp, "\t],\n");
+	
+	/* the last rate before the knee is the one effects should stay under */
+	if (knee >= 0)
+		fprintf(fp, "\t\"knee_pps\": %u,\n", steps[knee].target);
+	else
+		fprintf(fp, "\t\"knee_pps\": null,\n");
+	fprintf(fp, "\t\"safe_fps\": %u\n}\n", knee > 0
+		? steps[knee - 1].target
+		: knee < 0 && count ? steps[count - 1].target : 0
+	);
+	
+	fclose(fp);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *errstr;
+	const char *output = "harpoon-bench.json";
+	struct harpoon *hp;
+	struct step steps[64];
+	uint32_t *samples;
+	unsigned start = 50;
+	unsigned max = 4000;
+	unsigned msec = 1000;
+	double factor = 1.25;
+	double rate;
+	double baseline = 0; /* lowest p50 so far */
+	const struct mode *mode = 0;
+	const char *modeParam = 0;
+	int count = 0;
+	int knee = -1;
+	int i;
+	
+	/* step through arguments */
+	for (i = 1; i < argc; i += 2)
+	{
+#define ARGMATCH(ALIAS, NAME) (!strcasecmp(this, "-" ALIAS) \
+	|| !strcasecmp(this, "--" NAME))
+		const char *this = argv[i];
+		const char *param = argv[i + 1];
+		
+		if (!param)
+			showargs();
+			
+		if (ARGMATCH("s", "start"))
+			start = strtoul(param, 0, 0);
+		else if (ARGMATCH("m", "max"))
+			max = strtoul(param, 0, 0);
+		else if (ARGMATCH("f", "factor"))
+			factor = strtod(param, 0);
+		else if (ARGMATCH("t", "time"))
+			msec = strtoul(param, 0, 0);
+		else if (ARGMATCH("o", "output"))
+			output = param;
+		else
+		{
+			int k;
+			
+			for (k = 0; k < (int)(sizeof(modes) / sizeof(*modes)); ++k)
+				if (!strcasecmp(this, modes[k].alias) || !strcasecmp(this, modes[k].name))
+					break;
+			if (k == (int)(sizeof(modes) / sizeof(*modes)))
+				showargs();
+			mode = &modes[k];
+			modeParam = param;
+		}
+#undef ARGMATCH
+	}
+	if (!start || start > max || factor <= 1 || !msec)
+		die("invalid arguments");
+		
+	/* the last mode given runs instead of the ramp */
+	if (mode)
+	{
+		mode->run(modeParam);
+		return 0;
+	}
+	
+	if (!(samples = malloc(sizeof(*samples) * ((uint64_t)max * msec / 1000 + 1 + KNEE_MIN_SAMPLES))))
+		die("memory error");
+		
+	hp = harpoon_new();
+	
+	if ((errstr = harpoon_connect(hp)))
+		die("%s", errstr);
+		
+	fprintf(stderr, "%10s %10s %10s %10s %10s %8s\n"
+		, "target/s", "achieved/s", "p50 us", "p99 us", "p99.9 us", "errors"
+	);
+	
+	/* ramp the rate up until it stops keeping pace */
+	for (rate = start; rate <= max && count < (int)(sizeof(steps) / sizeof(*steps)); rate *= factor)
+	{
+		struct step *s = &steps[count];
+		
+		s->target = rate;
+		run_step(hp, s, msec, samples);
+		count += 1;
+		
+		fprintf(stderr, "%10u %10.1f %10.1f %10.1f %10.1f %8lu\n"
+			, s->target, s->achieved, s->p50, s->p99, s->p999, s->errors
+		);
+		
+		if (!harpoon_isConnected(hp))
+			die("mouse disconnected during the benchmark");
+			
+		if (s->achieved < s->target * KNEE_RATE_RATIO
+			|| (baseline && s->p50 > baseline * KNEE_P50_RATIO)
+			|| s->errors
+		)
+		{
+			knee = count - 1;
+			break;
+		}
+		
+		if (!baseline || s->p50 < baseline)
+			baseline = s->p50;
+	}
+	
+	if (knee >= 0)
+		fprintf(stderr, "knee at %u packets/s; safe rate %u\n"
+			, steps[knee].target
+			, knee ? steps[knee - 1].target : 0
+		);
+	else
+		fprintf(stderr, "no knee found up to %u packets/s\n", max);
+		
+	write_report(output, steps, count, knee);
+	
+	harpoon_delete(hp);
+	free(samples);
+	
+	return 0;
+}
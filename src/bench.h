@@ -0,0 +1,37 @@
+/*
+ * bench.h <z64.me>
+ *
+ * what the benchmarks in harpoon-bench share; each
+ * lives in a bench-*.c file of its own, and bench.c
+ * runs the one its arguments pick
+ *
+ */
+
+#ifndef BENCH_H_INCLUDED
+#define BENCH_H_INCLUDED
+
+#include <stdint.h>
+
+/* descriptors polled for a handle, at most */
+#define BENCH_MAX_POLLFDS 16
+
+/* fatal error message */
+void die(const char *fmt, ...);
+
+/* nanoseconds on the monotonic clock, and of CPU time used by this process */
+uint64_t now_nsec(void);
+uint64_t cpu_nsec(void);
+void sleep_until(uint64_t nsec);
+
+/* qsort() order for latency samples, and a percentile of them in usec */
+int compare_u32(const void *a, const void *b);
+double percentile(const uint32_t *sorted, unsigned long n, double p);
+
+/* the benchmarks, each given its option's argument */
+void bench_contexts(const char *param);
+void bench_backends(const char *param);
+void bench_lanes(const char *param);
+void bench_layers(const char *param);
+void bench_idle(const char *param);
+
+#endif /* BENCH_H_INCLUDED */
@@ -10,10 +10,41 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
 
 #include "harpoon.h"
 
 #define DPIMODE_COUNT 6
+#define SCRIPT_LOOP_DEPTH 16
+
+/* one pre-encoded script command */
+struct step
+{
+	enum
+	{
+		STEP_PACKET
+		, STEP_POLLRATE /* encoded when sent, as it restarts the mouse */
+		, STEP_SLEEP
+		, STEP_LOOP
+		, STEP_END
+	} type;
+	int arg;   /* pollrate msec, sleep msec, or loop count (0 = forever) */
+	int jump;  /* loop: index of its end; end: index of its loop */
+	int left;  /* loop iterations remaining, while running */
+	harpoonPacket data[HARPOON_PACKET_SIZE];
+};
+
+struct script
+{
+	struct step *step;
+	int count;
+	int alloc;
+};
+
+/* script line being parsed, for error messages */
+static int scriptLine = 0;
 
 struct dpimode
 {
@@ -30,6 +61,8 @@ static void die(const char *fmt, ...)
 		exit(EXIT_FAILURE);
 		
 	fprintf(stderr, "[!] ");
+	if (scriptLine)
+		fprintf(stderr, "script line %d: ", scriptLine);
 	va_start(ap, fmt);
 	vfprintf(stderr, fmt, ap);
 	va_end(ap);
@@ -50,6 +83,15 @@ static void showargs(void)
 	P("                  e.g. --only 012345 (enables all modes)");
 	P("  -s, --simple    lock mouse into one color and precision setting");
 	P("                  e.g. --simple precision 0xHexColor");
+	P("  -f, --script    run commands from a file, or - for stdin, one per line:");
+	P("                    dpi index precision 0xHexColor");
+	P("                    only 012345");
+	P("                    simple precision 0xHexColor");
+	P("                    color 0xHexColor");
+	P("                    mode index");
+	P("                    polling Hertz");
+	P("                    sleep milliseconds");
+	P("                    loop [count] ... end");
 #undef P
 	exit(EXIT_FAILURE);
 }
@@ -93,10 +135,280 @@ static int get_precision_from_string(const char *str)
 	return precision;
 }
 
+/* retrieve and validate DPI mode index */
+static int get_index_from_string(const char *str)
+{
+	int index;
+	
+	if (!str
+		|| sscanf(str, "%d", &index) != 1
+		|| index < 0
+		|| index >= DPIMODE_COUNT
+	)
+		die(
+			"invalid index '%s'; needs decimal value between 0 and %d"
+			, str ? str : ""
+			, DPIMODE_COUNT - 1
+		);
+		
+	return index;
+}
+
+/* append a step to a script */
+static struct step *script_push(struct script *sc, int type)
+{
+	struct step *step;
+	
+	if (sc->count == sc->alloc)
+	{
+		sc->alloc = sc->alloc ? sc->alloc * 2 : 64;
+		if (!(sc->step = realloc(sc->step, sc->alloc * sizeof(*sc->step))))
+			die("memory error");
+	}
+	step = &sc->step[sc->count++];
+	memset(step, 0, sizeof(*step));
+	step->type = type;
+	
+	return step;
+}
+
+/* append a packet step, keeping a copy of the encoded packet */
+static void script_pushPacket(struct script *sc, const harpoonPacket *sig)
+{
+	memcpy(script_push(sc, STEP_PACKET)->data, sig, HARPOON_PACKET_SIZE);
+}
+
+/* parse a whole script, encoding every packet up front */
+static void script_load(struct script *sc, const char *path)
+{
+	int loops[SCRIPT_LOOP_DEPTH];
+	int depth = 0;
+	char line[256];
+	FILE *fp;
+	
+	if (!strcmp(path, "-"))
+		fp = stdin;
+	else if (!(fp = fopen(path, "r")))
+		die("failed to open script '%s'", path);
+		
+	while (fgets(line, sizeof(line), fp))
+	{
+		const char *sep = " \t\r\n";
+		const char *cmd = strtok(line, sep);
+		const char *a = strtok(0, sep);
+		const char *b = strtok(0, sep);
+		const char *c = strtok(0, sep);
+		
+		scriptLine += 1;
+		
+		/* blank lines and comments */
+		if (!cmd || *cmd == '#')
+			continue;
+			
+		if (!strcasecmp(cmd, "dpi") || !strcasecmp(cmd, "simple"))
+		{
+			bool simple = !strcasecmp(cmd, "simple");
+			int index = simple ? 0 : get_index_from_string(a);
+			int precision;
+			unsigned int color;
+			int k;
+			
+			if (simple)
+			{
+				c = b;
+				b = a;
+			}
+			if (!b || !c)
+				die("%s: not enough arguments", cmd);
+			precision = get_precision_from_string(b);
+			color = get_color_from_string(c);
+			
+			for (k = index; k < (simple ? DPIMODE_COUNT : index + 1); ++k)
+			{
+				script_pushPacket(sc, harpoonPacket_dpiconfig(
+					k
+					, precision /* x, y */
+					, precision
+					, color >> 16 /* r, g, b */
+					, color >> 8
+					, color
+				));
+				script_pushPacket(sc, harpoonPacket_dpimode(k)); /* use new mode */
+			}
+		}
+		else if (!strcasecmp(cmd, "only"))
+		{
+			bool enabled[DPIMODE_COUNT] = {0};
+			const char *s;
+			
+			if (!a)
+				die("%s: not enough arguments", cmd);
+				
+			for (s = a; *s; ++s)
+			{
+				if (*s < '0' || *s >= '0' + DPIMODE_COUNT)
+					die(
+						"'%s' invalid mode list, expecting only decimal values 0 - %d"
+						, a
+						, DPIMODE_COUNT - 1
+					);
+					
+				enabled[*s - '0'] = true;
+			}
+			
+			script_pushPacket(sc, harpoonPacket_dpisetenabled(
+				enabled[0]
+				, enabled[1]
+				, enabled[2]
+				, enabled[3]
+				, enabled[4]
+				, enabled[5]
+			));
+		}
+		else if (!strcasecmp(cmd, "color"))
+		{
+			unsigned int color;
+			
+			if (!a)
+				die("%s: not enough arguments", cmd);
+			color = get_color_from_string(a);
+			
+			script_pushPacket(sc, harpoonPacket_color(
+				color >> 16 /* r, g, b */
+				, color >> 8
+				, color
+			));
+		}
+		else if (!strcasecmp(cmd, "mode"))
+			script_pushPacket(sc, harpoonPacket_dpimode(get_index_from_string(a)));
+		else if (!strcasecmp(cmd, "polling"))
+		{
+			int polling;
+			
+			if (!a || sscanf(a, "%d", &polling) != 1
+				|| (polling != 1000
+					&& polling != 500
+					&& polling != 250
+					&& polling != 125
+				)
+			)
+				die("invalid polling rate; valid options: 1000, 500, 250, 125");
+				
+			script_push(sc, STEP_POLLRATE)->arg = 1000 / polling;
+		}
+		else if (!strcasecmp(cmd, "sleep"))
+		{
+			int msec;
+			
+			if (!a || sscanf(a, "%d", &msec) != 1 || msec < 0)
+				die("invalid sleep '%s'; expecting milliseconds", a ? a : "");
+				
+			script_push(sc, STEP_SLEEP)->arg = msec;
+		}
+		else if (!strcasecmp(cmd, "loop"))
+		{
+			int count = 0;
+			
+			if (a && (sscanf(a, "%d", &count) != 1 || count < 0))
+				die("invalid loop count '%s'", a);
+			if (depth == SCRIPT_LOOP_DEPTH)
+				die("loops nested too deeply");
+				
+			script_push(sc, STEP_LOOP)->arg = count;
+			loops[depth++] = sc->count - 1;
+		}
+		else if (!strcasecmp(cmd, "end"))
+		{
+			struct step *end;
+			
+			if (!depth)
+				die("'end' without 'loop'");
+				
+			end = script_push(sc, STEP_END);
+			end->jump = loops[--depth];
+			sc->step[end->jump].jump = sc->count - 1;
+		}
+		else
+			die("unknown command '%s'", cmd);
+	}
+	
+	if (depth)
+		die("'loop' without 'end'");
+	scriptLine = 0;
+	
+	if (fp != stdin)
+		fclose(fp);
+}
+
+/* nanoseconds on the monotonic clock */
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* play back a parsed script; sleeps are measured from when the
+ * previous one ended, so time spent sending does not accumulate
+ */
+static void script_run(struct script *sc, struct harpoon *hp)
+{
+	uint64_t timeline = now_nsec();
+	int i;
+	
+	for (i = 0; i < sc->count; ++i)
+	{
+		struct step *step = &sc->step[i];
+		
+		switch (step->type)
+		{
+			case STEP_PACKET:
+				harpoon_send(hp, step->data);
+				break;
+				
+			case STEP_POLLRATE:
+				harpoon_send(hp, harpoonPacket_pollrate(step->arg));
+				timeline = now_nsec();
+				break;
+				
+			case STEP_SLEEP:
+			{
+				struct timespec ts;
+				
+				timeline += step->arg * 1000000ull;
+				if (timeline < now_nsec())
+					timeline = now_nsec();
+				ts.tv_sec = timeline / 1000000000;
+				ts.tv_nsec = timeline % 1000000000;
+				while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR)
+					;
+				break;
+			}
+			
+			case STEP_LOOP:
+				step->left = step->arg;
+				break;
+				
+			case STEP_END:
+			{
+				struct step *loop = &sc->step[step->jump];
+				
+				if (!loop->arg || --loop->left > 0)
+					i = step->jump;
+				break;
+			}
+		}
+	}
+}
+
 int main(int argc, char *argv[])
 {
 	const char *errstr = 0;
 	const char *only = 0;
+	const char *scriptPath = 0;
+	struct script script = {0};
 	struct harpoon *hp = 0;
 	struct dpimode dpimode[DPIMODE_COUNT] = {0};
 	int polling = 0;
@@ -169,6 +481,19 @@ int main(int argc, char *argv[])
 			
 			if (!only)
 				die("arg %s not enough arguments", this);
+				
+			/* skip argument and param(s) */
+			i += 2;
+		}
+		else if (ARGMATCH("f", "script"))
+		{
+			scriptPath = PARAM(0);
+			
+			if (!scriptPath)
+				die("arg %s not enough arguments", this);
+				
+			/* skip argument and param(s) */
+			i += 2;
 		}
 		else if (ARGMATCH("s", "simple"))
 		{
@@ -202,6 +527,10 @@ int main(int argc, char *argv[])
 #undef PARAM
 	}
 	
+	/* the whole script is parsed and encoded before connecting */
+	if (scriptPath)
+		script_load(&script, scriptPath);
+	
 	hp = harpoon_new();
 	
 	if ((errstr = harpoon_connect(hp)))
@@ -270,6 +599,12 @@ int main(int argc, char *argv[])
 		));
 	}
 	
+	if (scriptPath)
+	{
+		script_run(&script, hp);
+		free(script.step);
+	}
+	
 	harpoon_delete(hp);
 	
 	return 0;
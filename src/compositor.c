@@ -0,0 +1,284 @@
+/*
+ * compositor.c <z64.me>
+ *
+ * blends several color sources (a base color,
+ * effects, short notifications) into the one
+ * LED color, sending it only when it changes
+ *
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "harpoon.h"
+
+#define LAYER_MAX 32
+
+/* a color that failed to go out is retried this soon */
+#define RETRY_MSEC 50
+
+struct layer
+{
+	int id;
+	int priority;
+	uint8_t rgb[3];
+	uint8_t alpha;
+	enum harpoonBlend blend;
+	uint64_t expires; /* msec on the monotonic clock; 0 = never */
+};
+
+struct harpoonCompositor
+{
+	struct harpoon *hp;
+	struct layer layer[LAYER_MAX]; /* sorted by priority, lowest first */
+	int count;
+	uint64_t nextExpiry; /* earliest layer expiry; 0 = none */
+	bool dirty;
+	bool forced;
+	bool hasSent;
+	uint8_t sent[3];
+};
+
+/*
+ *
+ * private
+ *
+ */
+
+/* milliseconds on the monotonic clock */
+static uint64_t compositor__msec(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+static struct layer *compositor__find(struct harpoonCompositor *c, int id)
+{
+	int i;
+	
+	for (i = 0; i < c->count; ++i)
+		if (c->layer[i].id == id)
+			return &c->layer[i];
+			
+	return 0;
+}
+
+static void compositor__removeAt(struct harpoonCompositor *c, int index)
+{
+	c->count -= 1;
+	memmove(&c->layer[index], &c->layer[index + 1], (c->count - index) * sizeof(*c->layer));
+	c->dirty = true;
+}
+
+/* keep layers sorted after the one at 'index' changed priority */
+static void compositor__sort(struct harpoonCompositor *c, int index)
+{
+	struct layer tmp = c->layer[index];
+	
+	while (index > 0 && c->layer[index - 1].priority > tmp.priority)
+	{
+		c->layer[index] = c->layer[index - 1];
+		index -= 1;
+	}
+	while (index + 1 < c->count && c->layer[index + 1].priority <= tmp.priority)
+	{
+		c->layer[index] = c->layer[index + 1];
+		index += 1;
+	}
+	c->layer[index] = tmp;
+}
+
+static void compositor__findNextExpiry(struct harpoonCompositor *c)
+{
+	int i;
+	
+	c->nextExpiry = 0;
+	for (i = 0; i < c->count; ++i)
+	{
+		uint64_t e = c->layer[i].expires;
+		
+		if (e && (!c->nextExpiry || e < c->nextExpiry))
+			c->nextExpiry = e;
+	}
+}
+
+/* one channel of 'src' blended over 'dst' */
+static uint8_t compositor__blend(uint8_t dst, uint8_t src, uint8_t alpha, enum harpoonBlend blend)
+{
+	int out;
+	
+	switch (blend)
+	{
+		case HARPOON_BLEND_ADD:
+			out = dst + src > 255 ? 255 : dst + src;
+			break;
+			
+		case HARPOON_BLEND_MULTIPLY:
+			out = dst * src / 255;
+			break;
+			
+		case HARPOON_BLEND_SCREEN:
+			out = 255 - (255 - dst) * (255 - src) / 255;
+			break;
+			
+		default:
+			out = src;
+			break;
+	}
+	
+	return dst + (out - dst) * alpha / 255;
+}
+
+/*
+ *
+ * public
+ *
+ */
+
+struct harpoonCompositor *harpoonCompositor_new(struct harpoon *hp)
+{
+	struct harpoonCompositor *c;
+	
+	assert(hp);
+	
+	if (!(c = calloc(1, sizeof(*c))))
+		return 0;
+		
+	c->hp = hp;
+	
+	return c;
+}
+
+void harpoonCompositor_delete(struct harpoonCompositor *c)
+{
+	free(c);
+}
+
+int harpoonCompositor_set(struct harpoonCompositor *c, int id, int priority, uint32_t rgb, uint8_t alpha, enum harpoonBlend blend, unsigned lifetime_msec)
+{
+	struct layer next = {
+		.id = id
+		, .priority = priority
+		, .rgb = { rgb >> 16, rgb >> 8, rgb }
+		, .alpha = alpha
+		, .blend = blend
+		, .expires = lifetime_msec ? compositor__msec() + lifetime_msec : 0
+	};
+	struct layer *l;
+	
+	assert(c);
+	
+	if (!(l = compositor__find(c, id)))
+	{
+		if (c->count == LAYER_MAX)
+			return 1;
+			
+		l = &c->layer[c->count++];
+		*l = next;
+	}
+	else if (l->priority == next.priority
+		&& !memcmp(l->rgb, next.rgb, sizeof(next.rgb))
+		&& l->alpha == next.alpha
+		&& l->blend == next.blend
+		&& l->expires == next.expires
+	)
+		return 0; /* nothing changed */
+	else
+		*l = next;
+		
+	compositor__sort(c, l - c->layer);
+	compositor__findNextExpiry(c);
+	c->dirty = true;
+	
+	return 0;
+}
+
+void harpoonCompositor_remove(struct harpoonCompositor *c, int id)
+{
+	struct layer *l;
+	
+	assert(c);
+	
+	if (!(l = compositor__find(c, id)))
+		return;
+		
+	compositor__removeAt(c, l - c->layer);
+	compositor__findNextExpiry(c);
+}
+
+void harpoonCompositor_invalidate(struct harpoonCompositor *c)
+{
+	assert(c);
+	
+	c->forced = true;
+}
+
+int harpoonCompositor_update(struct harpoonCompositor *c)
+{
+	uint64_t now;
+	
+	assert(c);
+	
+	/* drop expired layers; nothing to do between deadlines */
+	if (c->nextExpiry && (now = compositor__msec()) >= c->nextExpiry)
+	{
+		int i;
+		
+		for (i = c->count - 1; i >= 0; --i)
+			if (c->layer[i].expires && c->layer[i].expires <= now)
+				compositor__removeAt(c, i);
+				
+		compositor__findNextExpiry(c);
+	}
+	
+	if (c->dirty || c->forced)
+	{
+		uint8_t out[3] = {0};
+		int i;
+		int k;
+		
+		for (i = 0; i < c->count; ++i)
+		{
+			struct layer *l = &c->layer[i];
+			
+			for (k = 0; k < 3; ++k)
+				out[k] = compositor__blend(out[k], l->rgb[k], l->alpha, l->blend);
+		}
+		
+		/* only a visible change costs a packet; one that
+		 * fails to go out is retried on the next update
+		 */
+		c->dirty = false;
+		if (c->forced
+			|| !c->hasSent
+			|| memcmp(out, c->sent, sizeof(out))
+		)
+		{
+			if (!harpoon_sendColor(c->hp, out[0], out[1], out[2]))
+			{
+				memcpy(c->sent, out, sizeof(out));
+				c->hasSent = true;
+				c->forced = false;
+			}
+			else
+				c->dirty = true;
+		}
+	}
+	
+	if (!c->nextExpiry)
+		return c->dirty ? RETRY_MSEC : -1;
+		
+	now = compositor__msec();
+	if (c->nextExpiry <= now)
+		return 0;
+	
+	if (c->dirty && c->nextExpiry - now > RETRY_MSEC)
+		return RETRY_MSEC;
+		
+	return c->nextExpiry - now;
+}
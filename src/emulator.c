@@ -0,0 +1,1223 @@
+/*
+ * emulator.c <z64.me>
+ *
+ * an LD_PRELOAD library that stands in for libusb
+ * and pretends a Corsair Harpoon is plugged in,
+ * for measuring the harpoon programs without one
+ *
+ *   LD_PRELOAD=bin/linux/libharpoon-emu.so bin/linux/harpoon-monitor
+ *
+ * tuning, all optional, via environment variables:
+ *   HARPOON_EMU_LATENCY_US   time the mouse spends on each packet (default 1000)
+ *   HARPOON_EMU_RESTART_MS   time the mouse is gone after a pollrate packet (default 2000)
+ *   HARPOON_EMU_UNPLUG_AFTER unplug the mouse after this many packets (default never)
+ *   HARPOON_EMU_REPLUG_MS    time the mouse stays unplugged (default 1000)
+ *   HARPOON_EMU_LOG          file that receives one line per packet
+ *   HARPOON_EMU_NO_HOTPLUG   nonzero: no hotplug support, like some libusb builds
+ *
+ * sending SIGUSR1 to the process unplugs or replugs the mouse
+ *
+ * the usbfs backend is served too: opening the mouse's device
+ * node, and ioctl() and close() on it, are intercepted; its URBs
+ * complete on the same schedule as libusb transfers would
+ *
+ */
+
+#define _GNU_SOURCE /* RTLD_NEXT */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <linux/usbdevice_fs.h>
+#include <libusb-1.0/libusb.h>
+
+/* device info */
+#define dev_idVendor   0x1b1c
+#define dev_idProduct  0x1b3c
+
+/* output interface */
+#define out_bInterfaceNumber  1
+#define out_bEndpointAddress  0x02 /* EP 2 OUT */
+#define out_wMaxPacketSize    0x0040
+
+/* where the mouse's device node appears */
+#define node_DIR  "/dev/bus/usb"
+#define node_BUS  1
+
+/* libusb's own types are opaque, so these are ours to define;
+ * like libusb's, every context but the default one holds an
+ * eventfd and a timerfd of its own, so what a context costs
+ * is comparable, even though this one never waits on them
+ */
+struct libusb_context
+{
+	int refcount;
+	int event;
+	int timer;
+};
+
+struct libusb_device
+{
+	int unused;
+};
+
+struct libusb_device_handle
+{
+	unsigned generation; /* matches emu.generation while still valid */
+	bool claimed;
+};
+
+/* as many programs sharing one context as anyone would need */
+#define HOTPLUG_MAX 16
+
+/* a registered hotplug callback */
+struct hotplug
+{
+	libusb_hotplug_callback_fn fn; /* 0 = unused */
+	void *udata;
+	int events;
+};
+
+/* an asynchronous transfer that has been submitted */
+struct pending
+{
+	struct libusb_transfer *transfer; /* or... */
+	struct usbdevfs_urb *urb;         /* ...through the device node */
+	uint64_t due;
+	int status;
+	struct pending *next;
+};
+
+static struct
+{
+	pthread_mutex_t lock;
+	bool ready;
+	
+	/* configuration */
+	uint64_t latency;     /* usec per packet */
+	uint64_t restartTime; /* usec after a pollrate packet */
+	uint64_t replugTime;  /* usec spent unplugged */
+	unsigned long unplugAfter;
+	bool noHotplug;
+	FILE *log;
+	
+	/* device state */
+	struct libusb_context context;
+	struct libusb_device device;
+	struct libusb_device_handle handle;
+	unsigned generation;  /* bumped whenever the mouse goes away */
+	uint64_t absentUntil; /* mouse is restarting or unplugged until then */
+	uint64_t leaveAt;     /* mouse goes away once this packet is done */
+	uint64_t leaveUntil;
+	bool unplugged;       /* unplugged by signal, until the next one */
+	uint64_t busyUntil;   /* mouse handles one packet at a time */
+	unsigned long packets;
+	uint64_t epoch;
+	
+	struct pending *pending;
+	
+	/* the device node opened by the usbfs backend */
+	struct libusb_device_handle node;
+	int nodeFd;           /* -1 = not open */
+	struct pending *urbs; /* submitted, not yet reaped */
+	
+	/* event loop integration */
+	int timer;  /* timerfd, expires at the next completion or hotplug event */
+	int wakeup; /* eventfd, written by the signal handler */
+	struct libusb_pollfd pollfds[2];
+	struct hotplug hotplug[HOTPLUG_MAX];
+	int hotplugs;  /* how many are registered */
+	bool reported; /* presence last reported through hotplug */
+} emu = { .lock = PTHREAD_MUTEX_INITIALIZER, .nodeFd = -1 };
+
+static volatile sig_atomic_t emu_toggle = 0;
+
+/*
+ *
+ * private
+ *
+ */
+
+/* microseconds on the monotonic clock */
+static uint64_t emu__now(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void emu__sleepUntil(uint64_t usec)
+{
+	struct timespec ts = { usec / 1000000, (usec % 1000000) * 1000 };
+	
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR)
+		;
+}
+
+static uint64_t emu__env(const char *name, uint64_t fallback)
+{
+	const char *str = getenv(name);
+	
+	return str ? strtoull(str, 0, 0) : fallback;
+}
+
+static void emu__onSignal(int sig)
+{
+	uint64_t one = 1;
+	
+	emu_toggle = 1;
+	if (write(emu.wakeup, &one, sizeof(one)) < 0)
+		return;
+		
+	(void)sig;
+}
+
+/* the mouse goes away; any open handle becomes stale */
+static void emu__remove(uint64_t until)
+{
+	emu.generation += 1;
+	emu.absentUntil = until;
+	emu.handle.claimed = false;
+	emu.node.claimed = false;
+	
+	/* like the kernel's, a node whose device is gone polls writable */
+	if (emu.nodeFd >= 0)
+	{
+		uint64_t count;
+		
+		if (read(emu.nodeFd, &count, sizeof(count)) < 0)
+			return;
+	}
+}
+
+/* the mouse goes away when the packet it is handling is done */
+static void emu__leave(uint64_t at, uint64_t until)
+{
+	emu.leaveAt = at;
+	emu.leaveUntil = until;
+}
+
+/* read configuration once, the first time any entry point is used */
+static void emu__init(void)
+{
+	const char *logpath;
+	
+	if (emu.ready)
+		return;
+	emu.ready = true;
+	
+	emu.latency = emu__env("HARPOON_EMU_LATENCY_US", 1000);
+	emu.restartTime = emu__env("HARPOON_EMU_RESTART_MS", 2000) * 1000;
+	emu.replugTime = emu__env("HARPOON_EMU_REPLUG_MS", 1000) * 1000;
+	emu.unplugAfter = emu__env("HARPOON_EMU_UNPLUG_AFTER", 0);
+	emu.noHotplug = emu__env("HARPOON_EMU_NO_HOTPLUG", 0);
+	emu.epoch = emu__now();
+	emu.generation = 1;
+	
+	if ((logpath = getenv("HARPOON_EMU_LOG")))
+	{
+		if (!(emu.log = fopen(logpath, "w")))
+			fprintf(stderr, "[emu] failed to open '%s'\n", logpath);
+		else
+			setvbuf(emu.log, 0, _IOLBF, 0);
+	}
+	
+	emu.timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	emu.wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	emu.pollfds[0].fd = emu.timer;
+	emu.pollfds[0].events = POLLIN;
+	emu.pollfds[1].fd = emu.wakeup;
+	emu.pollfds[1].events = POLLIN;
+	
+	signal(SIGUSR1, emu__onSignal);
+}
+
+/* whether the mouse is currently on the bus */
+static bool emu__present(void)
+{
+	if (emu_toggle)
+	{
+		emu_toggle = 0;
+		emu.unplugged = !emu.unplugged;
+		if (emu.unplugged)
+			emu__remove(0);
+		fprintf(stderr, "[emu] %s\n", emu.unplugged ? "unplugged" : "replugged");
+	}
+	
+	if (emu.leaveAt && emu__now() >= emu.leaveAt)
+	{
+		emu.leaveAt = 0;
+		emu__remove(emu.leaveUntil);
+	}
+	
+	return !emu.unplugged && emu__now() >= emu.absentUntil;
+}
+
+/* whether a handle still refers to the mouse it was opened on */
+static bool emu__valid(const libusb_device_handle *handle)
+{
+	return handle
+		&& emu__present()
+		&& handle->generation == emu.generation
+	;
+}
+
+/* the mouse's address on the bus, which changes each time it reappears */
+static unsigned emu__address(void)
+{
+	return 1 + emu.generation % 127;
+}
+
+/* set the timer for whichever event comes next */
+static void emu__arm(void)
+{
+	struct itimerspec its = {0};
+	uint64_t now = emu__now();
+	uint64_t next = 0;
+	struct pending *p;
+	
+	/* a presence change not reported yet is due right away */
+	if (emu.hotplugs && emu__present() != emu.reported)
+		next = now;
+		
+	if (emu.pending && (!next || emu.pending->due < next))
+		next = emu.pending->due;
+		
+	/* URBs are reaped in any order; a discarded one is due at once */
+	for (p = emu.urbs; p; p = p->next)
+		if (!next || p->due < next)
+			next = p->due ? p->due : now;
+		
+	if (emu.hotplugs && emu.leaveAt && (!next || emu.leaveAt < next))
+		next = emu.leaveAt;
+		
+	/* the mouse coming back after a restart or scheduled unplug */
+	if (emu.hotplugs
+		&& !emu.unplugged
+		&& emu.absentUntil > now
+		&& (!next || emu.absentUntil < next)
+	)
+		next = emu.absentUntil;
+		
+	/* an all-zero value would disarm the timer */
+	if (next)
+	{
+		next = next > now ? next : now + 1;
+		its.it_value.tv_sec = next / 1000000;
+		its.it_value.tv_nsec = (next % 1000000) * 1000;
+	}
+	
+	timerfd_settime(emu.timer, TFD_TIMER_ABSTIME, &its, 0);
+}
+
+/* model the mouse receiving one packet; returns when it will be done */
+static int emu__receive(libusb_device_handle *handle, unsigned char endpoint, const unsigned char *data, int length, uint64_t *done)
+{
+	uint64_t now = emu__now();
+	int i;
+	
+	emu__init();
+	
+	if (!emu__valid(handle))
+		return LIBUSB_ERROR_NO_DEVICE;
+		
+	if (!handle->claimed || endpoint != (out_bEndpointAddress | LIBUSB_ENDPOINT_OUT))
+		return LIBUSB_ERROR_INVALID_PARAM;
+		
+	if (length > out_wMaxPacketSize)
+		return LIBUSB_ERROR_OVERFLOW;
+		
+	/* packets are handled one after another */
+	*done = (emu.busyUntil > now ? emu.busyUntil : now) + emu.latency;
+	emu.busyUntil = *done;
+	emu.packets += 1;
+	
+	if (emu.log)
+	{
+		fprintf(emu.log, "%.6f", (now - emu.epoch) / 1000000.0);
+		for (i = 0; i < length; ++i)
+			fprintf(emu.log, " %02x", data[i]);
+		fprintf(emu.log, "\n");
+	}
+	
+	/* changing the polling rate restarts the mouse */
+	if (length >= 2 && data[0] == 0x07 && data[1] == 0x0a)
+		emu__leave(*done, *done + emu.restartTime);
+		
+	/* scheduled unplug */
+	else if (emu.unplugAfter && !(emu.packets % emu.unplugAfter))
+		emu__leave(*done, *done + emu.replugTime);
+		
+	emu__arm();
+	
+	return 0;
+}
+
+/*
+ *
+ * public (libusb replacements)
+ *
+ */
+
+int libusb_init(libusb_context **ctx)
+{
+	libusb_context *c;
+	
+	pthread_mutex_lock(&emu.lock);
+	emu__init();
+	if (!ctx)
+		emu.context.refcount += 1;
+	pthread_mutex_unlock(&emu.lock);
+	
+	if (!ctx)
+		return 0;
+		
+	if (!(c = calloc(1, sizeof(*c))))
+		return LIBUSB_ERROR_NO_MEM;
+	c->event = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	c->timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (c->event < 0 || c->timer < 0)
+	{
+		libusb_exit(c);
+		return LIBUSB_ERROR_OTHER;
+	}
+	*ctx = c;
+		
+	return 0;
+}
+
+void libusb_exit(libusb_context *ctx)
+{
+	if (!ctx || ctx == &emu.context)
+	{
+		pthread_mutex_lock(&emu.lock);
+		if (emu.context.refcount)
+			emu.context.refcount -= 1;
+		pthread_mutex_unlock(&emu.lock);
+		return;
+	}
+	
+	if (ctx->event >= 0)
+		close(ctx->event);
+	if (ctx->timer >= 0)
+		close(ctx->timer);
+	free(ctx);
+}
+
+int libusb_set_option(libusb_context *ctx, enum libusb_option option, ...)
+{
+	(void)ctx;
+	(void)option;
+	
+	return 0;
+}
+
+libusb_device_handle *libusb_open_device_with_vid_pid(libusb_context *ctx, uint16_t vendor_id, uint16_t product_id)
+{
+	libusb_device_handle *handle = 0;
+	
+	pthread_mutex_lock(&emu.lock);
+	emu__init();
+	if (vendor_id == dev_idVendor
+		&& product_id == dev_idProduct
+		&& emu__present()
+	)
+	{
+		handle = &emu.handle;
+		handle->generation = emu.generation;
+	}
+	pthread_mutex_unlock(&emu.lock);
+	
+	(void)ctx;
+	
+	return handle;
+}
+
+void libusb_close(libusb_device_handle *dev_handle)
+{
+	pthread_mutex_lock(&emu.lock);
+	if (dev_handle && dev_handle->generation == emu.generation)
+		dev_handle->claimed = false;
+	pthread_mutex_unlock(&emu.lock);
+}
+
+libusb_device *libusb_get_device(libusb_device_handle *dev_handle)
+{
+	return dev_handle ? &emu.device : 0;
+}
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+	ssize_t n = 0;
+	
+	(void)ctx;
+	
+	if (!(*list = calloc(2, sizeof(**list))))
+		return LIBUSB_ERROR_NO_MEM;
+		
+	pthread_mutex_lock(&emu.lock);
+	emu__init();
+	if (emu__present())
+		(*list)[n++] = &emu.device;
+	pthread_mutex_unlock(&emu.lock);
+	
+	return n;
+}
+
+void libusb_free_device_list(libusb_device **list, int unref_devices)
+{
+	(void)unref_devices;
+	
+	free(list);
+}
+
+int libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+	(void)dev;
+	
+	memset(desc, 0, sizeof(*desc));
+	desc->bLength = sizeof(*desc);
+	desc->bDescriptorType = 0x01; /* device */
+	desc->bcdUSB = 0x0200;
+	desc->bMaxPacketSize0 = out_wMaxPacketSize;
+	desc->idVendor = dev_idVendor;
+	desc->idProduct = dev_idProduct;
+	desc->bNumConfigurations = 1;
+	
+	return 0;
+}
+
+uint8_t libusb_get_bus_number(libusb_device *dev)
+{
+	(void)dev;
+	
+	return node_BUS;
+}
+
+uint8_t libusb_get_device_address(libusb_device *dev)
+{
+	uint8_t address;
+	
+	(void)dev;
+	
+	pthread_mutex_lock(&emu.lock);
+	address = emu__address();
+	pthread_mutex_unlock(&emu.lock);
+	
+	return address;
+}
+
+int libusb_get_max_packet_size(libusb_device *dev, unsigned char endpoint)
+{
+	int rval;
+	
+	pthread_mutex_lock(&emu.lock);
+	emu__init();
+	if (!dev || !emu__present() || !emu.handle.claimed || emu.handle.generation != emu.generation)
+		rval = LIBUSB_ERROR_NO_DEVICE;
+	else if ((endpoint & 0x7f) != out_bEndpointAddress)
+		rval = LIBUSB_ERROR_NOT_FOUND;
+	else
+		rval = out_wMaxPacketSize;
+	pthread_mutex_unlock(&emu.lock);
+	
+	return rval;
+}
+
+int libusb_set_auto_detach_kernel_driver(libusb_device_handle *dev_handle, int enable)
+{
+	(void)enable;
+	
+	return dev_handle ? 0 : LIBUSB_ERROR_INVALID_PARAM;
+}
+
+int libusb_claim_interface(libusb_device_handle *dev_handle, int interface_number)
+{
+	int rval = 0;
+	
+	pthread_mutex_lock(&emu.lock);
+	if (!emu__valid(dev_handle))
+		rval = LIBUSB_ERROR_NO_DEVICE;
+	else if (interface_number != out_bInterfaceNumber)
+		rval = LIBUSB_ERROR_NOT_FOUND;
+	else
+		dev_handle->claimed = true;
+	pthread_mutex_unlock(&emu.lock);
+	
+	return rval;
+}
+
+int libusb_release_interface(libusb_device_handle *dev_handle, int interface_number)
+{
+	(void)interface_number;
+	
+	if (!dev_handle)
+		return LIBUSB_ERROR_NO_DEVICE;
+		
+	pthread_mutex_lock(&emu.lock);
+	dev_handle->claimed = false;
+	pthread_mutex_unlock(&emu.lock);
+	
+	return 0;
+}
+
+static void LIBUSB_CALL emu__onBulk(struct libusb_transfer *transfer)
+{
+	*(int *)transfer->user_data = 1;
+}
+
+/* as in libusb itself, a synchronous transfer is an asynchronous
+ * one allocated for the occasion, submitted, and waited upon, so
+ * allocations and CPU time measured through here stay comparable
+ */
+int libusb_bulk_transfer(libusb_device_handle *dev_handle, unsigned char endpoint, unsigned char *data, int length, int *actual_length, unsigned int timeout)
+{
+	struct libusb_transfer *transfer;
+	uint64_t deadline = emu__now() + timeout * 1000ull;
+	bool timedOut = false;
+	int completed = 0;
+	int rval;
+	
+	if (actual_length)
+		*actual_length = 0;
+		
+	if (!(transfer = libusb_alloc_transfer(0)))
+		return LIBUSB_ERROR_NO_MEM;
+		
+	libusb_fill_bulk_transfer(transfer, dev_handle, endpoint, data, length, emu__onBulk, &completed, timeout);
+	if ((rval = libusb_submit_transfer(transfer)))
+	{
+		libusb_free_transfer(transfer);
+		return rval;
+	}
+	
+	while (!completed)
+	{
+		struct timeval tv = { 1, 0 };
+		uint64_t now = emu__now();
+	
+		if (timeout && !timedOut && now >= deadline)
+		{
+			libusb_cancel_transfer(transfer);
+			timedOut = true;
+		}
+		else if (timeout && !timedOut)
+		{
+			tv.tv_sec = (deadline - now) / 1000000;
+			tv.tv_usec = (deadline - now) % 1000000;
+		}
+		libusb_handle_events_timeout_completed(&emu.context, &tv, &completed);
+	}
+	
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED)
+	{
+		if (actual_length)
+			*actual_length = transfer->actual_length;
+	}
+	else
+		rval = timedOut ? LIBUSB_ERROR_TIMEOUT : LIBUSB_ERROR_IO;
+	libusb_free_transfer(transfer);
+		
+	return rval;
+}
+
+/* behaves like a kernel without usbfs device memory support */
+unsigned char *libusb_dev_mem_alloc(libusb_device_handle *dev_handle, size_t length)
+{
+	(void)dev_handle;
+	(void)length;
+	
+	return 0;
+}
+
+int libusb_dev_mem_free(libusb_device_handle *dev_handle, unsigned char *buffer, size_t length)
+{
+	(void)dev_handle;
+	(void)buffer;
+	(void)length;
+	
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets)
+{
+	return calloc(1, sizeof(struct libusb_transfer)
+		+ iso_packets * sizeof(struct libusb_iso_packet_descriptor)
+	);
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer)
+{
+	if (transfer && (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER))
+		free(transfer->buffer);
+		
+	free(transfer);
+}
+
+int libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+	struct pending *p;
+	struct pending **tail;
+	uint64_t done;
+	int rval;
+	
+	if (!(p = calloc(1, sizeof(*p))))
+		return LIBUSB_ERROR_NO_MEM;
+		
+	pthread_mutex_lock(&emu.lock);
+	rval = emu__receive(
+		transfer->dev_handle
+		, transfer->endpoint
+		, transfer->buffer
+		, transfer->length
+		, &done
+	);
+	if (!rval)
+	{
+		p->transfer = transfer;
+		p->due = done;
+		p->status = LIBUSB_TRANSFER_COMPLETED;
+		
+		/* completions come back in submission order */
+		for (tail = &emu.pending; *tail; tail = &(*tail)->next)
+			;
+		*tail = p;
+		emu__arm();
+	}
+	pthread_mutex_unlock(&emu.lock);
+	
+	if (rval)
+		free(p);
+		
+	return rval;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+	struct pending *p;
+	int rval = LIBUSB_ERROR_NOT_FOUND;
+	
+	pthread_mutex_lock(&emu.lock);
+	for (p = emu.pending; p; p = p->next)
+	{
+		if (p->transfer == transfer)
+		{
+			p->status = LIBUSB_TRANSFER_CANCELLED;
+			p->due = 0;
+			rval = 0;
+		}
+	}
+	pthread_mutex_unlock(&emu.lock);
+	
+	return rval;
+}
+
+int libusb_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv, int *completed)
+{
+	uint64_t deadline = emu__now();
+	bool handled = false;
+	
+	(void)ctx;
+	
+	/* libusb itself would crash on this */
+	if (!tv)
+	{
+		fprintf(stderr, "[emu] libusb_handle_events_timeout_completed() without a timeout\n");
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	deadline += tv->tv_sec * 1000000ull + tv->tv_usec;
+		
+	while (1)
+	{
+		struct pollfd fds[2];
+		struct pending *p = 0;
+		struct hotplug fire[HOTPLUG_MAX];
+		int fires = 0;
+		libusb_hotplug_event event = 0;
+		int i;
+		uint64_t now = emu__now();
+		uint64_t drain;
+		
+		if (completed && *completed)
+			return 0;
+			
+		pthread_mutex_lock(&emu.lock);
+		emu__init();
+		if (read(emu.timer, &drain, sizeof(drain)) < 0)
+			drain = 0;
+		if (read(emu.wakeup, &drain, sizeof(drain)) < 0)
+			drain = 0;
+			
+		/* report the mouse coming or going first */
+		if (emu.hotplugs && emu__present() != emu.reported)
+		{
+			emu.reported = !emu.reported;
+			event = emu.reported
+				? LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED
+				: LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT
+			;
+			for (i = 0; i < HOTPLUG_MAX; ++i)
+				if (emu.hotplug[i].fn && (emu.hotplug[i].events & event))
+					fire[fires++] = emu.hotplug[i];
+		}
+		else if (emu.pending && emu.pending->due <= now)
+		{
+			p = emu.pending;
+			emu.pending = p->next;
+		}
+		emu__arm();
+		pthread_mutex_unlock(&emu.lock);
+		
+		if (event)
+		{
+			for (i = 0; i < fires; ++i)
+				fire[i].fn(&emu.context, &emu.device, event, fire[i].udata);
+			handled = true;
+			continue;
+		}
+		
+		/* complete one transfer, then check whether that was enough */
+		if (p)
+		{
+			struct libusb_transfer *transfer = p->transfer;
+			
+			transfer->status = p->status;
+			transfer->actual_length = p->status == LIBUSB_TRANSFER_COMPLETED
+				? transfer->length
+				: 0
+			;
+			free(p);
+			
+			if (transfer->callback)
+				transfer->callback(transfer);
+			if (transfer->flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+				libusb_free_transfer(transfer);
+				
+			handled = true;
+			continue;
+		}
+		
+		/* like libusb, return once something was handled */
+		if (handled || now >= deadline)
+			return 0;
+			
+		/* wait for the timer or a signal */
+		fds[0].fd = emu.timer;
+		fds[0].events = POLLIN;
+		fds[1].fd = emu.wakeup;
+		fds[1].events = POLLIN;
+		poll(fds, 2, (deadline - now + 999) / 1000);
+	}
+}
+
+/* like libusb, these wait at most a minute */
+int libusb_handle_events_completed(libusb_context *ctx, int *completed)
+{
+	struct timeval tv = { 60, 0 };
+	
+	return libusb_handle_events_timeout_completed(ctx, &tv, completed);
+}
+
+int libusb_handle_events(libusb_context *ctx)
+{
+	struct timeval tv = { 60, 0 };
+	
+	return libusb_handle_events_timeout_completed(ctx, &tv, 0);
+}
+
+/* lets a program tell it is running against the emulator */
+const struct libusb_version *libusb_get_version(void)
+{
+	static const struct libusb_version version = {
+		1, 0, 0, 0, "", "harpoon emulator"
+	};
+	
+	return &version;
+}
+
+const char *libusb_error_name(int errcode)
+{
+	switch (errcode)
+	{
+		case LIBUSB_SUCCESS: return "LIBUSB_SUCCESS";
+		case LIBUSB_ERROR_INVALID_PARAM: return "LIBUSB_ERROR_INVALID_PARAM";
+		case LIBUSB_ERROR_NO_DEVICE: return "LIBUSB_ERROR_NO_DEVICE";
+		case LIBUSB_ERROR_NOT_FOUND: return "LIBUSB_ERROR_NOT_FOUND";
+		case LIBUSB_ERROR_TIMEOUT: return "LIBUSB_ERROR_TIMEOUT";
+		case LIBUSB_ERROR_OVERFLOW: return "LIBUSB_ERROR_OVERFLOW";
+		case LIBUSB_ERROR_NO_MEM: return "LIBUSB_ERROR_NO_MEM";
+		case LIBUSB_ERROR_NOT_SUPPORTED: return "LIBUSB_ERROR_NOT_SUPPORTED";
+		default: return "**UNKNOWN**";
+	}
+}
+
+int libusb_has_capability(uint32_t capability)
+{
+	pthread_mutex_lock(&emu.lock);
+	emu__init();
+	pthread_mutex_unlock(&emu.lock);
+	
+	return capability == LIBUSB_CAP_HAS_CAPABILITY
+		|| (capability == LIBUSB_CAP_HAS_HOTPLUG && !emu.noHotplug)
+	;
+}
+
+int libusb_hotplug_register_callback(libusb_context *ctx, int events, int flags, int vendor_id, int product_id, int dev_class, libusb_hotplug_callback_fn cb_fn, void *user_data, libusb_hotplug_callback_handle *callback_handle)
+{
+	int i;
+	
+	(void)ctx;
+	(void)flags;
+	(void)dev_class;
+	
+	/* only the mouse ever comes or goes */
+	if ((vendor_id != LIBUSB_HOTPLUG_MATCH_ANY && vendor_id != dev_idVendor)
+		|| (product_id != LIBUSB_HOTPLUG_MATCH_ANY && product_id != dev_idProduct)
+	)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+		
+	pthread_mutex_lock(&emu.lock);
+	emu__init();
+	for (i = 0; i < HOTPLUG_MAX && emu.hotplug[i].fn; ++i)
+		;
+	if (i == HOTPLUG_MAX)
+	{
+		pthread_mutex_unlock(&emu.lock);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	if (!emu.hotplugs)
+		emu.reported = emu__present();
+	emu.hotplug[i].fn = cb_fn;
+	emu.hotplug[i].udata = user_data;
+	emu.hotplug[i].events = events;
+	emu.hotplugs += 1;
+	pthread_mutex_unlock(&emu.lock);
+	
+	if (callback_handle)
+		*callback_handle = i + 1;
+		
+	return 0;
+}
+
+void libusb_hotplug_deregister_callback(libusb_context *ctx, libusb_hotplug_callback_handle callback_handle)
+{
+	(void)ctx;
+	
+	pthread_mutex_lock(&emu.lock);
+	if (callback_handle >= 1
+		&& callback_handle <= HOTPLUG_MAX
+		&& emu.hotplug[callback_handle - 1].fn
+	)
+	{
+		emu.hotplug[callback_handle - 1].fn = 0;
+		emu.hotplugs -= 1;
+	}
+	pthread_mutex_unlock(&emu.lock);
+}
+
+const struct libusb_pollfd **libusb_get_pollfds(libusb_context *ctx)
+{
+	const struct libusb_pollfd **list;
+	
+	(void)ctx;
+	
+	if (!(list = calloc(3, sizeof(*list))))
+		return 0;
+		
+	pthread_mutex_lock(&emu.lock);
+	emu__init();
+	list[0] = &emu.pollfds[0];
+	list[1] = &emu.pollfds[1];
+	pthread_mutex_unlock(&emu.lock);
+	
+	return list;
+}
+
+void libusb_free_pollfds(const struct libusb_pollfd **pollfds)
+{
+	free(pollfds);
+}
+
+void libusb_set_pollfd_notifiers(libusb_context *ctx, libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb, void *user_data)
+{
+	/* the emulator's descriptors never change */
+	(void)ctx;
+	(void)added_cb;
+	(void)removed_cb;
+	(void)user_data;
+}
+
+int libusb_get_next_timeout(libusb_context *ctx, struct timeval *tv)
+{
+	/* every deadline is already covered by the timer descriptor */
+	(void)ctx;
+	(void)tv;
+	
+	return 0;
+}
+
+/*
+ *
+ * public (usbfs replacements)
+ *
+ */
+
+/* a URB the mouse is done with, or an errno value */
+static int emu__reap(struct usbdevfs_urb **out, bool block)
+{
+	while (1)
+	{
+		struct pending **p;
+		struct pending **found = 0;
+		uint64_t now = emu__now();
+		uint64_t next = 0;
+		
+		/* whichever is done first, discarded ones before all else */
+		for (p = &emu.urbs; *p; p = &(*p)->next)
+		{
+			if (!found || (*p)->due < (*found)->due)
+				found = p;
+		}
+		if (found)
+			next = (*found)->due;
+			
+		if (found && next <= now)
+		{
+			struct pending *done = *found;
+			struct usbdevfs_urb *urb = done->urb;
+			
+			*found = done->next;
+			urb->status = done->status;
+			urb->actual_length = done->status ? 0 : urb->buffer_length;
+			*out = urb;
+			free(done);
+			emu__arm();
+			
+			return 0;
+		}
+		
+		if (!found)
+			return emu__valid(&emu.node) ? EAGAIN : ENODEV;
+			
+		if (!block)
+			return EAGAIN;
+			
+		pthread_mutex_unlock(&emu.lock);
+		emu__sleepUntil(next);
+		pthread_mutex_lock(&emu.lock);
+	}
+}
+
+/* requests made on the device node; returns an errno value */
+static int emu__nodeIoctl(unsigned long request, void *arg)
+{
+	struct pending *p;
+	uint64_t done;
+	int rval;
+	
+	/* like the kernel, giving URBs back works after the mouse is gone */
+	if (request == USBDEVFS_REAPURB || request == USBDEVFS_REAPURBNDELAY)
+		return emu__reap(arg, request == USBDEVFS_REAPURB);
+		
+	if (!emu__valid(&emu.node))
+		return ENODEV;
+		
+	switch (request)
+	{
+		case USBDEVFS_DISCONNECT_CLAIM:
+			if (((struct usbdevfs_disconnect_claim*)arg)->interface != out_bInterfaceNumber)
+				return EINVAL;
+			emu.node.claimed = true;
+			return 0;
+			
+		case USBDEVFS_CLAIMINTERFACE:
+			if (*(unsigned int*)arg != out_bInterfaceNumber)
+				return EINVAL;
+			emu.node.claimed = true;
+			return 0;
+			
+		case USBDEVFS_RELEASEINTERFACE:
+			emu.node.claimed = false;
+			return 0;
+			
+		/* attaching or detaching the kernel driver */
+		case USBDEVFS_IOCTL:
+		case USBDEVFS_CONNECTINFO:
+			return 0;
+			
+		case USBDEVFS_SUBMITURB:
+		{
+			struct usbdevfs_urb *urb = arg;
+			struct pending **tail;
+			
+			if (urb->type != USBDEVFS_URB_TYPE_BULK)
+				return EINVAL;
+				
+			if (!(p = calloc(1, sizeof(*p))))
+				return ENOMEM;
+				
+			if ((rval = emu__receive(&emu.node, urb->endpoint, urb->buffer, urb->buffer_length, &done)))
+			{
+				free(p);
+				return rval == LIBUSB_ERROR_NO_DEVICE ? ENODEV : EINVAL;
+			}
+			
+			p->urb = urb;
+			p->due = done;
+			for (tail = &emu.urbs; *tail; tail = &(*tail)->next)
+				;
+			*tail = p;
+			emu__arm();
+			return 0;
+		}
+		
+		case USBDEVFS_DISCARDURB:
+			for (p = emu.urbs; p; p = p->next)
+			{
+				if (p->urb == arg && p->due)
+				{
+					p->status = -ENOENT;
+					p->due = 0;
+					emu__arm();
+					return 0;
+				}
+			}
+			return EINVAL;
+	}
+	
+	return ENOTTY;
+}
+
+int open(const char *path, int flags, ...)
+{
+	static int (*next)(const char *path, int flags, ...);
+	unsigned bus;
+	unsigned address;
+	mode_t mode = 0;
+	va_list ap;
+	int fd = -1;
+	int err = ENOENT;
+	
+	if (flags & (O_CREAT | O_TMPFILE))
+	{
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	
+	if (strncmp(path, node_DIR "/", sizeof(node_DIR))
+		|| sscanf(path, node_DIR "/%u/%u", &bus, &address) != 2
+	)
+	{
+		if (!next)
+			next = (int (*)(const char*, int, ...))dlsym(RTLD_NEXT, "open");
+			
+		return next(path, flags, mode);
+	}
+	
+	/* an eventfd stands in for the node; it is kept full so it never
+	 * polls writable, and the timer among libusb's descriptors wakes
+	 * the event loop when a URB is done instead, until the mouse goes
+	 */
+	pthread_mutex_lock(&emu.lock);
+	emu__init();
+	if (emu.nodeFd >= 0)
+		err = EBUSY;
+	else if (bus == node_BUS && address == emu__address() && emu__present())
+	{
+		uint64_t full = UINT64_MAX - 1;
+		
+		fd = eventfd(0, EFD_NONBLOCK | ((flags & O_CLOEXEC) ? EFD_CLOEXEC : 0));
+		if (fd >= 0 && write(fd, &full, sizeof(full)) == sizeof(full))
+		{
+			emu.nodeFd = fd;
+			emu.node.generation = emu.generation;
+			emu.node.claimed = false;
+		}
+		else
+			err = EIO;
+	}
+	pthread_mutex_unlock(&emu.lock);
+	
+	if (fd < 0 || emu.nodeFd != fd)
+	{
+		errno = err;
+		return -1;
+	}
+	
+	return fd;
+}
+
+int close(int fd)
+{
+	static int (*next)(int fd);
+	
+	if (!next)
+		next = (int (*)(int))dlsym(RTLD_NEXT, "close");
+		
+	pthread_mutex_lock(&emu.lock);
+	if (fd >= 0 && fd == emu.nodeFd)
+	{
+		struct pending *p;
+		
+		/* like the kernel, closing kills whatever is left */
+		while ((p = emu.urbs))
+		{
+			emu.urbs = p->next;
+			free(p);
+		}
+		emu.nodeFd = -1;
+		emu.node.claimed = false;
+	}
+	pthread_mutex_unlock(&emu.lock);
+	
+	return next(fd);
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	static int (*next)(int fd, unsigned long request, ...);
+	void *arg;
+	va_list ap;
+	int err;
+	
+	va_start(ap, request);
+	arg = va_arg(ap, void*);
+	va_end(ap);
+	
+	if (fd < 0 || fd != emu.nodeFd)
+	{
+		if (!next)
+			next = (int (*)(int, unsigned long, ...))dlsym(RTLD_NEXT, "ioctl");
+			
+		return next(fd, request, arg);
+	}
+	
+	pthread_mutex_lock(&emu.lock);
+	err = emu__nodeIoctl(request, arg);
+	pthread_mutex_unlock(&emu.lock);
+	
+	if (err)
+	{
+		errno = err;
+		return -1;
+	}
+	
+	return 0;
+}
@@ -13,29 +13,174 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <time.h>
 #include <libusb-1.0/libusb.h>
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <linux/usbdevice_fs.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* USDT probes for bpftrace or perf; each one is a single nop
+ * until a tracer attaches, and is left out without sys/sdt.h
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define USDT1(NAME, A)        DTRACE_PROBE1(harpoon, NAME, A)
+#define USDT2(NAME, A, B)     DTRACE_PROBE2(harpoon, NAME, A, B)
+#define USDT3(NAME, A, B, C)  DTRACE_PROBE3(harpoon, NAME, A, B, C)
+#endif
+#endif
+#ifndef USDT1
+#define USDT1(NAME, A)
+#define USDT2(NAME, A, B)
+#define USDT3(NAME, A, B, C)
+#endif
+
+/* what send probes call a packet: its second and third bytes, which
+ * tell apart 0x2201 color, 0x0a00 pollrate, 0x1302 dpimode,
+ * 0x1305 dpisetenabled, and 0x13d0 to 0x13d5 dpiconfig
+ */
+#define USDT_OPCODE(SIG)  ((SIG)[1] << 8 | (SIG)[2])
 
 #include "harpoon.h"
 
+/* device info */
+#define dev_idVendor   0x1b1c
+#define dev_idProduct  0x1b3c
+
+/* output interface */
+#define out_bInterfaceNumber  1
+#define out_bEndpointAddress  0x02 /* EP 2 OUT */
+#define out_wMaxPacketSize    0x0040
+
+/* connection monitoring for event loops */
+#define monitor_FALLBACK_MSEC  1000 /* without hotplug support, poll this often */
+#define monitor_RETRY_MSEC     100  /* after an arrival, retry connecting this often */
+#define monitor_RETRY_COUNT    20   /* ...this many times */
+
+/* reusable transfers, so sending allocates nothing */
+#define pool_SIZE  8
+
+/* where the usbfs backend finds device nodes */
+#define usbfs_DIR  "/dev/bus/usb"
+
+/* a color the filter skipped still goes out if nothing
+ * newer comes along for this long, e.g. as an animation ends
+ */
+#define filter_SETTLE_MSEC  250
+
+/* descriptors harpoon_handle_events() waits on itself */
+#define events_MAX_POLLFDS  16
+
+struct harpoonSlot
+{
+	struct libusb_transfer *transfer;
+#ifdef __linux__
+	struct usbdevfs_urb *urb; /* the usbfs backend's, filled in once */
+#endif
+	harpoonPacket *data;  /* out_wMaxPacketSize bytes */
+	bool isDevMem;        /* data is mapped from the device */
+	bool busy;
+	int done;
+	int result;           /* 0 on success, once done */
+	
+	/* asynchronous sends only */
+	struct harpoon *owner;
+	void (*onDone)(void *udata, int result);
+	void *udata;
+	void (*defer)(struct harpoon *hp);
+};
+
+/* send queue; control packets go out before cosmetic ones */
+#define queue_CONTROL_MAX  16
+
+struct harpoonQueued
+{
+	harpoonPacket data[out_wMaxPacketSize];
+	void (*defer)(struct harpoon *hp);
+};
+
 struct harpoon
 {
 	libusb_device_handle *device;
 	libusb_context *context;
+	bool ownsContext;     /* false if the caller's context is shared */
+	bool restarting;      /* a poll rate change is waiting to reconnect */
+	enum harpoonBackend backend; /* used by the next connection */
+	int usbfs;            /* device node opened by the usbfs backend; -1 = none */
 	void (*onConnect)(void *udata);
 	void (*onDisconnect)(void *udata);
 	void *onConnect_udata;
 	void *onDisconnect_udata;
+	
+	/* transfer pool; buffers live as long as the device handle */
+	struct harpoonSlot pool[pool_SIZE];
+	void (*deferred)(struct harpoon *hp); /* from an asynchronous send */
+	
+	/* asynchronous sends that finished, oldest first; each slot
+	 * stays busy until its callback has run; with a shared context,
+	 * another thread may be the one adding to the tail
+	 */
+	struct harpoonSlot *finished[pool_SIZE];
+	unsigned finishedHead;
+	atomic_uint finishedTail;
+	
+	/* control lane: fifo, never dropped */
+	struct harpoonQueued control[queue_CONTROL_MAX];
+	int controlHead;
+	int controlCount;
+	
+	/* cosmetic lane: only the newest frame is kept */
+	struct harpoonQueued cosmetic;
+	bool hasCosmetic;
+	
+	/* a packet that restarts the mouse waits for both lanes */
+	struct harpoonQueued restart;
+	bool hasRestart;
+	
+	/* the queued packet on its way to the mouse; one at a time,
+	 * so the next one is chosen only once it is needed
+	 */
+	bool sending;
+	enum harpoonPriority sendingLane;
+	bool sendingFiltered; /* a color the filter must remember */
+	int32_t sendingLab[3];
+	
+	/* perceptual color filter */
+	unsigned filterThreshold; /* thousandths of an OKLab unit; 0 = off */
+	unsigned filterKeyframe;  /* msec; 0 = never force */
+	bool hasLastColor;
+	int32_t lastLab[3];
+	uint64_t lastColorTime;
+	unsigned long colorsSent;
+	unsigned long colorsSkipped;
+	bool hasSettle;       /* the last color skipped, until something newer goes out */
+	uint8_t settle[3];
+	uint64_t settleTime;
+	
+	/* event loop integration */
+	bool hasHotplug;
+	libusb_hotplug_callback_handle hotplug;
+	atomic_bool arrived;  /* set by hotplug callback, on any thread */
+	atomic_bool left;     /* set by hotplug callback, on any thread */
+	int wakeup[2];        /* read and write ends, one eventfd on Linux; -1 = private context */
+	struct pollfd pollfds[events_MAX_POLLFDS]; /* libusb's, kept with a private context */
+	int pollfdCount;      /* -1 = fetch them again */
+	uint64_t monitorTime; /* when harpoon_monitor is next due; 0 = never */
+	int monitorRetries;
 };
 
-/* device info */
-#define idVendor   0x1b1c
-#define idProduct  0x1b3c
-
-/* output interface */
-#define out_bInterfaceNumber  1
-#define out_bEndpointAddress  0x02 /* EP 2 OUT */
-#define out_wMaxPacketSize    0x0040
-
 /*
  *
  * private
@@ -64,6 +209,8 @@ static void die(const char *fmt, ...)
 /* this deferred function gives the mouse time to restart before reconnecting */
 static void harpoonPacket__defer_pollrate(struct harpoon *hp)
 {
+	USDT1(restart_start, hp);
+	hp->restarting = true;
 	harpoon_disconnect(hp);
 	
 #ifdef HARPOON_NO_MAIN_LOOP /* program has no main loop, so wait here */
@@ -80,12 +227,634 @@ static void harpoonPacket__defer_pollrate(struct harpoon *hp)
 #endif
 }
 
+/* discard anything still waiting in the send queue */
+static void harpoon__clearQueue(struct harpoon *hp)
+{
+	hp->controlHead = 0;
+	hp->controlCount = 0;
+	hp->hasCosmetic = false;
+	hp->hasRestart = false;
+	hp->hasSettle = false;
+}
+
+/* milliseconds on the monotonic clock */
+static uint64_t harpoon__msec(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+/* integer cube root */
+static uint32_t harpoon__cbrt(uint64_t v)
+{
+	uint32_t r = 0;
+	int bit;
+	
+	for (bit = 12; bit >= 0; --bit)
+	{
+		uint64_t t = r | (1u << bit);
+		
+		if (t * t * t <= v)
+			r = t;
+	}
+	
+	return r;
+}
+
+/* fixed-point OKLab approximation of an sRGB color, 1.0 = 4096 */
+static void harpoon__colorLab(uint8_t r, uint8_t g, uint8_t b, int32_t lab[3])
+{
+	static uint16_t linear[256]; /* sRGB to linear, 1.0 = 65535 */
+	uint32_t lr;
+	uint32_t lg;
+	uint32_t lb;
+	int32_t l;
+	int32_t m;
+	int32_t s;
+	
+	if (!linear[255])
+	{
+		int i;
+		
+		for (i = 0; i < 256; ++i)
+		{
+			double c = i / 255.0;
+			
+			c = c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+			linear[i] = c * 65535 + 0.5;
+		}
+	}
+	lr = linear[r];
+	lg = linear[g];
+	lb = linear[b];
+	
+	/* linear rgb to cone response, then its cube root in 1.0 = 4096 */
+	l = harpoon__cbrt((uint64_t)((1688 * lr + 2197 * lg +  211 * lb) >> 12) << 20);
+	m = harpoon__cbrt((uint64_t)(( 868 * lr + 2788 * lg +  440 * lb) >> 12) << 20);
+	s = harpoon__cbrt((uint64_t)(( 362 * lr + 1154 * lg + 2580 * lb) >> 12) << 20);
+	
+	lab[0] = ( 862 * l + 3251 * m -   17 * s) >> 12;
+	lab[1] = (8102 * l - 9947 * m + 1846 * s) >> 12;
+	lab[2] = ( 106 * l + 3206 * m - 3312 * s) >> 12;
+}
+
+/* whether a color packet is too close to the last one sent to be seen;
+ * 'lab' receives the packet's color either way
+ */
+static bool harpoon__colorInvisible(struct harpoon *hp, const harpoonPacket *sig, int32_t lab[3])
+{
+	int64_t dist = 0;
+	int64_t threshold;
+	int i;
+	
+	harpoon__colorLab(sig[5], sig[6], sig[7], lab);
+	
+	if (!hp->hasLastColor)
+		return false;
+	
+	/* the LED must never drift for too long */
+	if (hp->filterKeyframe
+		&& harpoon__msec() - hp->lastColorTime >= hp->filterKeyframe
+	)
+		return false;
+	
+	for (i = 0; i < 3; ++i)
+	{
+		int64_t d = lab[i] - hp->lastLab[i];
+		
+		dist += d * d;
+	}
+	threshold = hp->filterThreshold * 4096 / 1000;
+	
+	return dist < threshold * threshold;
+}
+
+/* a color packet went out; later ones are compared against it */
+static void harpoon__colorSent(struct harpoon *hp, const int32_t lab[3])
+{
+	memcpy(hp->lastLab, lab, sizeof(hp->lastLab));
+	hp->lastColorTime = harpoon__msec();
+	hp->hasLastColor = true;
+	hp->hasSettle = false;
+	hp->colorsSent += 1;
+}
+
+/* a color packet was skipped; should it be the last one for a while,
+ * harpoon_handle_events() sends it anyway
+ */
+static void harpoon__colorSkipped(struct harpoon *hp, const harpoonPacket *sig)
+{
+	memcpy(hp->settle, sig + 5, sizeof(hp->settle));
+	hp->settleTime = harpoon__msec() + filter_SETTLE_MSEC;
+	hp->hasSettle = true;
+	hp->colorsSkipped += 1;
+}
+
+/* with a shared context, callbacks may run on another thread, so
+ * nothing would wake the loop waiting to call harpoon_handle_events()
+ * unless the handle's own descriptor becomes readable too
+ */
+static void harpoon__wake(struct harpoon *hp)
+{
+	uint64_t one = 1;
+	
+	if (hp->wakeup[1] < 0)
+		return;
+		
+	/* a full pipe or counter is already readable */
+	if (write(hp->wakeup[1], &one, hp->wakeup[0] == hp->wakeup[1] ? sizeof(one) : 1) < 0)
+		return;
+}
+
+static void harpoon__drainWakeup(struct harpoon *hp)
+{
+	uint64_t drain[8];
+	
+	if (hp->wakeup[0] < 0)
+		return;
+		
+	while (read(hp->wakeup[0], drain, sizeof(drain)) > 0)
+		;
+}
+
+static void harpoon__closeWakeup(struct harpoon *hp)
+{
+	if (hp->wakeup[0] >= 0)
+		close(hp->wakeup[0]);
+	if (hp->wakeup[1] >= 0 && hp->wakeup[1] != hp->wakeup[0])
+		close(hp->wakeup[1]);
+	hp->wakeup[0] = hp->wakeup[1] = -1;
+}
+
+/* libusb's descriptors changed; only registered on a private
+ * context, as a shared one's notifiers belong to its owner
+ */
+static void LIBUSB_CALL harpoon__onPollfdAdded(int fd, short events, void *udata)
+{
+	struct harpoon *hp = udata;
+	
+	hp->pollfdCount = -1;
+	(void)fd;
+	(void)events;
+}
+
+static void LIBUSB_CALL harpoon__onPollfdRemoved(int fd, void *udata)
+{
+	struct harpoon *hp = udata;
+	
+	hp->pollfdCount = -1;
+	(void)fd;
+}
+
+/* whether either backend has the device open */
+static bool harpoon__isOpen(struct harpoon *hp)
+{
+	return hp->device || hp->usbfs >= 0;
+}
+
+/* a transfer finished, through either backend */
+static void harpoon__complete(struct harpoonSlot *slot, int result)
+{
+	struct harpoon *hp = slot->owner;
+	
+	slot->result = result;
+	slot->done = 1;
+	
+	/* blocking sends pick the result up themselves */
+	if (!slot->onDone)
+		return;
+	
+	/* libusb can't be used from in here, so the callback
+	 * waits for harpoon__finish() to run it
+	 */
+	hp->finished[atomic_load(&hp->finishedTail) % pool_SIZE] = slot;
+	atomic_fetch_add(&hp->finishedTail, 1);
+	harpoon__wake(hp);
+}
+
+/* run the callbacks of asynchronous sends that finished */
+static void harpoon__finish(struct harpoon *hp)
+{
+	while (hp->finishedHead != atomic_load(&hp->finishedTail))
+	{
+		struct harpoonSlot *slot = hp->finished[hp->finishedHead % pool_SIZE];
+		void (*onDone)(void *udata, int result) = slot->onDone;
+		
+		hp->finishedHead += 1;
+		
+		/* a restart waits until every callback has run */
+		if (!slot->result && slot->defer)
+			hp->deferred = slot->defer;
+		
+		slot->onDone = 0;
+		slot->busy = false;
+		onDone(slot->udata, slot->result);
+	}
+}
+
+static void LIBUSB_CALL harpoon__onTransfer(struct libusb_transfer *transfer)
+{
+	harpoon__complete(transfer->user_data
+		, transfer->status != LIBUSB_TRANSFER_COMPLETED
+			|| transfer->actual_length != out_wMaxPacketSize
+	);
+}
+
+#ifdef __linux__
+/* find the mouse's device node through libusb, open it, and claim
+ * the interface; returns 0 on success, or else an error string
+ */
+static const char *harpoon__usbfsOpen(struct harpoon *hp)
+{
+	struct usbdevfs_disconnect_claim claim = {
+		.interface = out_bInterfaceNumber
+		, .flags = USBDEVFS_DISCONNECT_CLAIM_EXCEPT_DRIVER
+		, .driver = "usbfs"
+	};
+	unsigned int interface = out_bInterfaceNumber;
+	libusb_device **list;
+	char path[64] = {0};
+	ssize_t n;
+	ssize_t i;
+	
+	if ((n = libusb_get_device_list(hp->context, &list)) < 0)
+		return "libusb_get_device_list failed";
+		
+	for (i = 0; i < n && !*path; ++i)
+	{
+		struct libusb_device_descriptor desc;
+		
+		if (!libusb_get_device_descriptor(list[i], &desc)
+			&& desc.idVendor == dev_idVendor
+			&& desc.idProduct == dev_idProduct
+		)
+			snprintf(path, sizeof(path), usbfs_DIR "/%03u/%03u"
+				, libusb_get_bus_number(list[i])
+				, libusb_get_device_address(list[i])
+			);
+	}
+	libusb_free_device_list(list, 1);
+	
+	if (!*path)
+		return "device not found; is it plugged in?";
+		
+	if ((hp->usbfs = open(path, O_RDWR | O_CLOEXEC)) < 0)
+		return "failed to open the device node; are its permissions right?";
+		
+	/* detach the kernel driver and claim the interface in one go,
+	 * or in two on kernels older than 3.18
+	 */
+	if (ioctl(hp->usbfs, USBDEVFS_DISCONNECT_CLAIM, &claim))
+	{
+		struct usbdevfs_ioctl command = { out_bInterfaceNumber, USBDEVFS_DISCONNECT, 0 };
+		
+		ioctl(hp->usbfs, USBDEVFS_IOCTL, &command); /* fails if no driver is bound */
+		if (ioctl(hp->usbfs, USBDEVFS_CLAIMINTERFACE, &interface))
+		{
+			close(hp->usbfs);
+			hp->usbfs = -1;
+			return "USBDEVFS_CLAIMINTERFACE failed";
+		}
+	}
+	
+	return 0;
+}
+
+/* release the interface, hand it back to the kernel driver, and close */
+static void harpoon__usbfsClose(int fd)
+{
+	struct usbdevfs_ioctl command = { out_bInterfaceNumber, USBDEVFS_CONNECT, 0 };
+	unsigned int interface = out_bInterfaceNumber;
+	
+	ioctl(fd, USBDEVFS_RELEASEINTERFACE, &interface);
+	ioctl(fd, USBDEVFS_IOCTL, &command);
+	close(fd);
+}
+
+/* complete every URB the kernel is done with; 'block' waits for
+ * at least one; returns nonzero on errors other than running out
+ */
+static int harpoon__usbfsReap(int fd, bool block)
+{
+	struct usbdevfs_urb *urb;
+	bool reaped = false;
+	
+	while (!ioctl(fd, block ? USBDEVFS_REAPURB : USBDEVFS_REAPURBNDELAY, &urb))
+	{
+		block = false;
+		reaped = true;
+		harpoon__complete(urb->usercontext
+			, urb->status || urb->actual_length != out_wMaxPacketSize
+		);
+	}
+	
+	/* a mouse that is gone (e.g. restarting) has nothing left to give back */
+	if (errno == ENODEV && reaped)
+		return 0;
+		
+	return errno != EAGAIN && errno != EINTR;
+}
+#endif
+
+/* hand a slot to whichever backend has the device open */
+static int harpoon__submit(struct harpoon *hp, struct harpoonSlot *slot)
+{
+	slot->busy = true;
+	slot->done = 0;
+	
+#ifdef __linux__
+	if (hp->usbfs >= 0)
+	{
+		if (!ioctl(hp->usbfs, USBDEVFS_SUBMITURB, slot->urb))
+			return 0;
+	}
+	else
+#endif
+	if (!libusb_submit_transfer(slot->transfer))
+		return 0;
+		
+	slot->busy = false;
+	
+	return 1;
+}
+
+/* device memory, as libusb_dev_mem_alloc() would map it; 0 if unsupported */
+static harpoonPacket *harpoon__devMemAlloc(struct harpoon *hp)
+{
+#ifdef __linux__
+	void *mem;
+	
+	if (hp->usbfs >= 0)
+	{
+		mem = mmap(0, out_wMaxPacketSize, PROT_READ | PROT_WRITE, MAP_SHARED, hp->usbfs, 0);
+		
+		return mem == MAP_FAILED ? 0 : mem;
+	}
+#endif
+	return libusb_dev_mem_alloc(hp->device, out_wMaxPacketSize);
+}
+
+/* give every pool slot a buffer for the device just opened; buffers
+ * come from device memory when the kernel supports it, so the packet
+ * is encoded where the controller reads it from
+ */
+static bool harpoon__poolOpen(struct harpoon *hp)
+{
+	int i;
+	
+	for (i = 0; i < pool_SIZE; ++i)
+	{
+		struct harpoonSlot *slot = &hp->pool[i];
+		
+		if (!slot->transfer && !(slot->transfer = libusb_alloc_transfer(0)))
+			return false;
+#ifdef __linux__
+		if (!slot->urb && !(slot->urb = calloc(1, sizeof(*slot->urb))))
+			return false;
+#endif
+		
+		if ((slot->data = harpoon__devMemAlloc(hp)))
+			slot->isDevMem = true;
+		else if ((slot->data = aligned_alloc(out_wMaxPacketSize, out_wMaxPacketSize)))
+			slot->isDevMem = false;
+		else
+			return false;
+		
+#ifdef __linux__
+		/* only the buffer's contents change from one send to the next */
+		slot->urb->type = USBDEVFS_URB_TYPE_BULK;
+		slot->urb->endpoint = out_bEndpointAddress | LIBUSB_ENDPOINT_OUT;
+		slot->urb->buffer = slot->data;
+		slot->urb->buffer_length = out_wMaxPacketSize;
+		slot->urb->usercontext = slot;
+#endif
+		libusb_fill_bulk_transfer(
+			slot->transfer
+			, hp->device
+			, out_bEndpointAddress | LIBUSB_ENDPOINT_OUT
+			, slot->data
+			, out_wMaxPacketSize
+			, harpoon__onTransfer
+			, slot
+			, 0 /* no timeout */
+		);
+		slot->owner = hp;
+		slot->onDone = 0;
+		slot->busy = false;
+	}
+	
+	return true;
+}
+
+/* release pool buffers and close the device */
+static void harpoon__close(struct harpoon *hp)
+{
+	libusb_device_handle *device = hp->device;
+	int usbfs = hp->usbfs;
+	int i;
+	
+	if (!harpoon__isOpen(hp))
+		return;
+		
+	/* asynchronous sends still in flight are cancelled
+	 * before their buffers go away
+	 */
+	hp->device = 0;
+	hp->usbfs = -1;
+	for (i = 0; i < pool_SIZE; ++i)
+	{
+		if (!hp->pool[i].busy)
+			continue;
+#ifdef __linux__
+		if (usbfs >= 0)
+			ioctl(usbfs, USBDEVFS_DISCARDURB, hp->pool[i].urb);
+		else
+#endif
+		libusb_cancel_transfer(hp->pool[i].transfer);
+	}
+	for (i = 0; i < pool_SIZE; )
+	{
+		struct timeval tv = { 0, 100000 };
+		
+		if (!hp->pool[i].busy || hp->pool[i].done)
+			i += 1;
+#ifdef __linux__
+		else if (usbfs >= 0)
+		{
+			if (harpoon__usbfsReap(usbfs, true))
+				break;
+		}
+#endif
+		else if (libusb_handle_events_timeout_completed(hp->context, &tv, 0))
+			break;
+	}
+	
+	for (i = 0; i < pool_SIZE; ++i)
+	{
+		struct harpoonSlot *slot = &hp->pool[i];
+		
+		if (!slot->data)
+			continue;
+		
+		if (!slot->isDevMem)
+			free(slot->data);
+#ifdef __linux__
+		else if (usbfs >= 0)
+			munmap(slot->data, out_wMaxPacketSize);
+#endif
+		else
+			libusb_dev_mem_free(device, slot->data, out_wMaxPacketSize);
+		slot->data = 0;
+	}
+	
+#ifdef __linux__
+	if (usbfs >= 0)
+		harpoon__usbfsClose(usbfs);
+	else
+#endif
+	libusb_close(device);
+	
+	/* callbacks see the device as already closed */
+	harpoon__finish(hp);
+}
+
+/* the slot holding 'sig', or else a free one with 'sig' copied in;
+ * only colors are encoded straight into a slot, by harpoon_sendColor(),
+ * because only they are sent often enough to matter; every other packet
+ * comes from a harpoonPacket_*() builder, whose one static buffer per
+ * kind is shared by every handle and may be rebuilt while a send is
+ * still in flight, so the slot needs its own 64 bytes regardless
+ */
+static struct harpoonSlot *harpoon__slot(struct harpoon *hp, const harpoonPacket *sig)
+{
+	struct harpoonSlot *spare = 0;
+	int i;
+	
+	for (i = 0; i < pool_SIZE; ++i)
+	{
+		struct harpoonSlot *slot = &hp->pool[i];
+		
+		if (slot->data == sig)
+			return slot;
+		
+		if (!spare && !slot->busy && slot->data)
+			spare = slot;
+	}
+	
+	if (spare && sig)
+		memcpy(spare->data, sig, out_wMaxPacketSize);
+	
+	return spare;
+}
+
+/* libusb may only be used outside of its own callbacks, so
+ * hotplug events are noted here and acted upon afterwards;
+ * with a shared context, this runs on whichever thread
+ * handles its events
+ */
+static int LIBUSB_CALL harpoon__onHotplug(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *udata)
+{
+	struct harpoon *hp = udata;
+	
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+		atomic_store(&hp->arrived, true);
+	else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+		atomic_store(&hp->left, true);
+	harpoon__wake(hp);
+		
+	(void)ctx;
+	(void)device;
+	
+	return 0; /* stay registered */
+}
+
+static void harpoon__pump(struct harpoon *hp);
+
+/* a queued packet is done; a failed one is dropped like
+ * any other send that fails, and the next one goes out
+ */
+static void harpoon__onQueued(void *udata, int result)
+{
+	struct harpoon *hp = udata;
+	
+	hp->sending = false;
+	if (!result && hp->sendingFiltered)
+		harpoon__colorSent(hp, hp->sendingLab);
+		
+	harpoon__pump(hp);
+}
+
+/* start sending the next queued packet, unless one is already on its
+ * way; control packets always go first, and a color frame only once
+ * none are waiting, so a control packet waits behind at most one;
+ * a restart goes last, and nothing follows it to the old session
+ */
+static void harpoon__pump(struct harpoon *hp)
+{
+	struct harpoonQueued *q;
+	
+	while (!hp->sending && !hp->deferred && harpoon__isOpen(hp))
+	{
+		if (hp->controlCount)
+			q = &hp->control[hp->controlHead];
+		else if (hp->hasCosmetic)
+			q = &hp->cosmetic;
+		else if (hp->hasRestart)
+			q = &hp->restart;
+		else
+			return;
+			
+		hp->sendingLane = harpoonPacket_priority(q->data);
+		hp->sendingFiltered = hp->filterThreshold
+			&& hp->sendingLane == HARPOON_PRIORITY_COSMETIC
+		;
+		
+		/* skip color frames nobody would notice */
+		if (hp->sendingFiltered
+			&& harpoon__colorInvisible(hp, q->data, hp->sendingLab)
+		)
+			harpoon__colorSkipped(hp, q->data);
+		else
+		{
+			/* with every transfer in use, the next completion retries */
+			harpoonPacket__defer = q->defer;
+			if (harpoon_sendAsync(hp, q->data, harpoon__onQueued, hp))
+				return;
+			hp->sending = true;
+		}
+		
+		if (q == &hp->cosmetic)
+			hp->hasCosmetic = false;
+		else if (q == &hp->restart)
+			hp->hasRestart = false;
+		else
+		{
+			hp->controlHead = (hp->controlHead + 1) % queue_CONTROL_MAX;
+			hp->controlCount -= 1;
+		}
+	}
+}
+
 /*
  *
  * public
  *
  */
 
+/* LED color is the only cosmetic packet; everything else is control */
+enum harpoonPriority harpoonPacket_priority(const harpoonPacket *sig)
+{
+	assert(sig);
+	
+	if (sig[0] == 0x07 && sig[1] == 0x22)
+		return HARPOON_PRIORITY_COSMETIC;
+	
+	return HARPOON_PRIORITY_CONTROL;
+}
+
 /* construct LED color packet */
 const harpoonPacket *harpoonPacket_color(uint8_t r, uint8_t g, uint8_t b)
 {
@@ -162,52 +931,89 @@ const harpoonPacket *harpoonPacket_dpisetenabled(bool m0, bool m1, bool m2, bool
 
 void harpoon_delete(struct harpoon *hp)
 {
+	int i;
+	
 	if (!hp)
 		return;
 	
 	/* cleanup */
-	libusb_release_interface(hp->device, out_bInterfaceNumber);
+	if (hp->hasHotplug)
+		libusb_hotplug_deregister_callback(hp->context, hp->hotplug);
+	if (hp->device)
+		libusb_release_interface(hp->device, out_bInterfaceNumber);
 	
 	harpoon_disconnect(hp);
 	
-	libusb_exit(hp->context);
+	for (i = 0; i < pool_SIZE; ++i)
+	{
+		libusb_free_transfer(hp->pool[i].transfer);
+#ifdef __linux__
+		free(hp->pool[i].urb);
+#endif
+	}
+	
+	if (hp->ownsContext)
+		libusb_exit(hp->context);
+	harpoon__closeWakeup(hp);
 	free(hp);
 }
 
 void harpoon_disconnect(struct harpoon *hp)
 {
-	if (hp->device)
-		libusb_close(hp->device);
-	hp->device = 0;
+	USDT1(disconnect_start, hp);
+	harpoon__close(hp);
+	
+	/* queued packets were meant for the session that just ended */
+	harpoon__clearQueue(hp);
 	
 	if (hp->onDisconnect)
 		hp->onDisconnect(hp->onDisconnect_udata);
+	USDT1(disconnect_done, hp);
 }
 
-const char *harpoon_connect(struct harpoon *hp)
+static const char *harpoon__connect(struct harpoon *hp)
 {
 	int errcode;
 	
 	assert(hp);
 	
 	/* reinitialize to zero */
-	if (hp->device)
-		libusb_close(hp->device);
-	hp->device = 0;
+	harpoon__close(hp);
+	
+#ifdef __linux__
+	if (hp->backend == HARPOON_BACKEND_USBFS)
+	{
+		const char *errstr;
+		
+		if ((errstr = harpoon__usbfsOpen(hp)))
+			return errstr;
+	}
+	else
+#endif
+	{
+		/* fetch device */
+		if (!(hp->device = libusb_open_device_with_vid_pid(hp->context, dev_idVendor, dev_idProduct)))
+			return "libusb_open_device_with_vid_pid failed; is device plugged in?";
 	
-	/* fetch device */
-	if (!(hp->device = libusb_open_device_with_vid_pid(hp->context, idVendor, idProduct)))
-		return "libusb_open_device_with_vid_pid failed; is device plugged in?";
+		/* tell libusb to automatically detach kernel driver when
+		 * interface is claimed, and reattach when interface is released
+		 */
+		if ((errcode = libusb_set_auto_detach_kernel_driver(hp->device, true)))
+			return "libusb_set_auto_detach_kernel_driver failed";
 	
-	/* tell libusb to automatically detach kernel driver when
-	 * interface is claimed, and reattach when interface is released
-	 */
-	if ((errcode = libusb_set_auto_detach_kernel_driver(hp->device, true)))
-		return "libusb_set_auto_detach_kernel_driver failed";
+		/* now attempt to claim the interface */
+		if ((errcode = libusb_claim_interface(hp->device, out_bInterfaceNumber)))
+			return "libusb_claim_interface failed";
+	}
+	
+	if (!harpoon__poolOpen(hp))
+	{
+		harpoon__close(hp);
+		return "failed to allocate transfer pool";
+	}
 	
-	/* now attempt to claim the interface */
-	if ((errcode = libusb_claim_interface(hp->device, out_bInterfaceNumber)))
-		return "libusb_claim_interface failed";
+	/* the first color after connecting always goes out */
+	hp->hasLastColor = false;
 	
 	if (hp->onConnect)
 		hp->onConnect(hp->onConnect_udata);
@@ -215,20 +1021,122 @@ const char *harpoon_connect(struct harpoon *hp)
 	return 0;
 }
 
-struct harpoon *harpoon_new(void)
+const char *harpoon_connect(struct harpoon *hp)
+{
+	const char *errstr;
+	
+	USDT1(connect_start, hp);
+	errstr = harpoon__connect(hp);
+	USDT2(connect_done, hp, errstr != 0);
+	
+	/* the mouse is back after the restart a poll rate change caused */
+	if (!errstr && hp->restarting)
+	{
+		hp->restarting = false;
+		USDT1(restart_done, hp);
+	}
+	
+	return errstr;
+}
+
+int harpoon_new_with_context(struct harpoon **out, struct libusb_context *ctx)
 {
 	struct harpoon *hp = 0; /* misc */
+	const char *backend;
 	int errcode = 0;
 	
+	assert(out);
+	
+	*out = 0;
 	if (!(hp = calloc(1, sizeof(*hp))))
-		die("memory error");
+		return LIBUSB_ERROR_NO_MEM;
+	hp->usbfs = -1;
+	hp->wakeup[0] = hp->wakeup[1] = -1;
+	hp->pollfdCount = -1;
 	
-	/* initialize libusb context */
-	if ((errcode = libusb_init(&hp->context)))
-		die("libusb_init failed");
+	/* programs that don't pick a backend can be steered to one */
+	if ((backend = getenv("HARPOON_BACKEND")) && !strcmp(backend, "usbfs"))
+		harpoon_set_backend(hp, HARPOON_BACKEND_USBFS);
+	
+	/* share the caller's libusb context, or initialize one */
+	if (ctx)
+	{
+		hp->context = ctx;
+#ifdef __linux__
+		if ((hp->wakeup[0] = hp->wakeup[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+#else
+		if (pipe(hp->wakeup)
+			|| fcntl(hp->wakeup[0], F_SETFL, O_NONBLOCK)
+			|| fcntl(hp->wakeup[1], F_SETFL, O_NONBLOCK)
+		)
+#endif
+		{
+			harpoon__closeWakeup(hp);
+			free(hp);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+	}
+	else
+	{
+		if ((errcode = libusb_init(&hp->context)))
+		{
+			free(hp);
+			return errcode;
+		}
+		hp->ownsContext = true;
+		libusb_set_pollfd_notifiers(hp->context, harpoon__onPollfdAdded, harpoon__onPollfdRemoved, hp);
 #ifndef NDEBUG
-	libusb_set_option(hp->context, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_INFO);
+		libusb_set_option(hp->context, LIBUSB_OPTION_LOG_LEVEL, LIBUSB_LOG_LEVEL_INFO);
+#endif
+	}
+
+	/* with hotplug support, event loops only wake when the mouse
+	 * comes or goes; otherwise they fall back to periodic checks
+	 */
+	if (libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)
+		&& !libusb_hotplug_register_callback(
+			hp->context
+			, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT
+			, LIBUSB_HOTPLUG_NO_FLAGS
+			, dev_idVendor
+			, dev_idProduct
+			, LIBUSB_HOTPLUG_MATCH_ANY
+			, harpoon__onHotplug
+			, hp
+			, &hp->hotplug
+		)
+	)
+		hp->hasHotplug = true;
+		
+	/* the first harpoon_handle_events() attempts connecting */
+	hp->monitorTime = harpoon__msec();
+	
+	*out = hp;
+	
+	return 0;
+}
+
+int harpoon_set_backend(struct harpoon *hp, enum harpoonBackend backend)
+{
+	assert(hp);
+	
+#ifndef __linux__
+	if (backend == HARPOON_BACKEND_USBFS)
+		return 1;
 #endif
+
+	hp->backend = backend;
+	
+	return 0;
+}
+
+struct harpoon *harpoon_new(void)
+{
+	struct harpoon *hp = 0; /* misc */
+	int errcode = 0;
+	
+	if ((errcode = harpoon_new_with_context(&hp, 0)))
+		die("harpoon_new failed: %s", libusb_error_name(errcode));
 	
 	return hp;
 }
@@ -236,39 +1144,210 @@ struct harpoon *harpoon_new(void)
 int harpoon_send(struct harpoon *hp, const harpoonPacket *sig)
 {
 #define RETURN(X) { rval = X; goto L_return; }
+	struct harpoonSlot *slot;
 	int errcode;
-	int sent;
 	int rval = 0;
+	bool isColor;
+	int32_t lab[3];
 	
 	assert(hp);
 	assert(sig);
 	
-	if (!hp->device)
+	USDT2(send_start, hp, USDT_OPCODE(sig));
+	
+	if (!harpoon__isOpen(hp))
 		RETURN(1);
 	
-	/* transfer color code to mouse */
-	if ((errcode = libusb_bulk_transfer(
-			hp->device
-			, out_bEndpointAddress | LIBUSB_ENDPOINT_OUT
-			, (void*)sig
-			, out_wMaxPacketSize
-			, &sent
-			, 0 /* no timeout */
-		))
-		|| sent != out_wMaxPacketSize
-	)
+	/* skip color frames nobody would notice */
+	isColor = hp->filterThreshold
+		&& harpoonPacket_priority(sig) == HARPOON_PRIORITY_COSMETIC
+	;
+	if (isColor && harpoon__colorInvisible(hp, sig, lab))
 	{
+		harpoon__colorSkipped(hp, sig);
+		RETURN(0);
+	}
+	
+	/* transfer color code to mouse */
+	if (!(slot = harpoon__slot(hp, sig)))
+		RETURN(1);
+	if (harpoon__submit(hp, slot))
 		RETURN(1);
+	while (!slot->done)
+	{
+#ifdef __linux__
+		/* the kernel hands back URBs in any order, and
+		 * has given every one back once the device is gone
+		 */
+		if (hp->usbfs >= 0)
+		{
+			if (harpoon__usbfsReap(hp->usbfs, true) && !slot->done)
+				harpoon__complete(slot, 1);
+			continue;
+		}
+#endif
+		/* like libusb's own blocking transfers, give up on errors
+		 * by cancelling, and keep waiting for the callback
+		 */
+		if ((errcode = libusb_handle_events_completed(hp->context, &slot->done)) < 0
+			&& errcode != LIBUSB_ERROR_INTERRUPTED
+		)
+			libusb_cancel_transfer(slot->transfer);
 	}
+	slot->busy = false;
+	if (slot->result)
+		RETURN(1);
+	
+	if (isColor)
+		harpoon__colorSent(hp, lab);
 	
+	/* a restart that follows isn't part of the send */
+	USDT3(send_done, hp, USDT_OPCODE(sig), 0);
 	if (harpoonPacket__defer)
 		harpoonPacket__defer(hp);
+	harpoonPacket__defer = 0;
+	return 0;
 	
 L_return:
+	USDT3(send_done, hp, USDT_OPCODE(sig), rval);
 	harpoonPacket__defer = 0;
 	return rval;
 }
 
+int harpoon_sendAsync(struct harpoon *hp, const harpoonPacket *sig, void onDone(void *udata, int result), void *udata)
+{
+	struct harpoonSlot *slot;
+	void (*defer)(struct harpoon *hp) = harpoonPacket__defer;
+	
+	assert(hp);
+	assert(sig);
+	assert(onDone);
+	
+	harpoonPacket__defer = 0;
+	
+	if (!harpoon__isOpen(hp) || !(slot = harpoon__slot(hp, sig)))
+		return 1;
+		
+	slot->onDone = onDone;
+	slot->udata = udata;
+	slot->defer = defer;
+	if (harpoon__submit(hp, slot))
+	{
+		slot->onDone = 0;
+		return 1;
+	}
+	
+	return 0;
+}
+
+int harpoon_sendColor(struct harpoon *hp, uint8_t r, uint8_t g, uint8_t b)
+{
+	struct harpoonSlot *slot;
+	
+	assert(hp);
+	
+	if (!harpoon__isOpen(hp) || !(slot = harpoon__slot(hp, 0)))
+		return 1;
+	
+	/* encode straight into the transfer buffer */
+	memset(slot->data, 0, out_wMaxPacketSize);
+	slot->data[0] = 0x07;
+	slot->data[1] = 0x22;
+	slot->data[2] = 0x01;
+	slot->data[3] = 0x01;
+	slot->data[4] = 0x03;
+	slot->data[5] = r;
+	slot->data[6] = g;
+	slot->data[7] = b;
+	
+	return harpoon_send(hp, slot->data);
+}
+
+int harpoon_queue(struct harpoon *hp, const harpoonPacket *sig)
+{
+	struct harpoonQueued *q;
+	
+	assert(hp);
+	assert(sig);
+	
+	if (harpoonPacket__defer)
+	{
+		/* only the newest poll rate matters */
+		q = &hp->restart;
+		hp->hasRestart = true;
+	}
+	else if (harpoonPacket_priority(sig) == HARPOON_PRIORITY_COSMETIC)
+	{
+		/* a newer frame makes any unsent one stale */
+		q = &hp->cosmetic;
+		hp->hasCosmetic = true;
+	}
+	else
+	{
+		if (hp->controlCount >= queue_CONTROL_MAX)
+			return 1;
+		
+		q = &hp->control[(hp->controlHead + hp->controlCount) % queue_CONTROL_MAX];
+		hp->controlCount += 1;
+	}
+	
+	memcpy(q->data, sig, out_wMaxPacketSize);
+	q->defer = harpoonPacket__defer;
+	harpoonPacket__defer = 0;
+	
+	return 0;
+}
+
+int harpoon_flush(struct harpoon *hp)
+{
+	assert(hp);
+	
+	/* queued packets were meant for a mouse that is connected */
+	if (!harpoon__isOpen(hp))
+	{
+		harpoon__clearQueue(hp);
+		return 1;
+	}
+	
+	harpoon__pump(hp);
+		
+	return 0;
+}
+	
+int harpoon_pending(struct harpoon *hp, enum harpoonPriority lane)
+{
+	int n;
+	
+	assert(hp);
+	
+	if (lane == HARPOON_PRIORITY_COSMETIC)
+		n = hp->hasCosmetic;
+	else
+		n = hp->controlCount + hp->hasRestart;
+		
+	return n + (hp->sending && hp->sendingLane == lane);
+}
+
+void harpoon_set_colorFilter(struct harpoon *hp, unsigned threshold, unsigned keyframe_msec)
+{
+	assert(hp);
+	
+	hp->filterThreshold = threshold;
+	hp->filterKeyframe = keyframe_msec;
+	hp->hasLastColor = false;
+	hp->hasSettle = false;
+}
+
+void harpoon_get_colorFilterStats(struct harpoon *hp, unsigned long *sent, unsigned long *skipped)
+{
+	assert(hp);
+	
+	if (sent)
+		*sent = hp->colorsSent;
+	if (skipped)
+		*skipped = hp->colorsSkipped;
+}
+
 void harpoon_set_onConnect(struct harpoon *hp, void onConnect(void *udata), void *udata)
 {
 	assert(hp);
@@ -294,8 +1373,18 @@ int harpoon_isConnected(struct harpoon *hp)
 	
 	assert(hp);
 	
-	if (!hp->device)
+	if (!harpoon__isOpen(hp))
 		return 0;
+		
+#ifdef __linux__
+	/* every request but reaping fails once the device is gone */
+	if (hp->usbfs >= 0)
+	{
+		struct usbdevfs_connectinfo info;
+		
+		return !ioctl(hp->usbfs, USBDEVFS_CONNECTINFO, &info);
+	}
+#endif
 
 	if (!(d = libusb_get_device(hp->device)))
 		return 0;
@@ -305,12 +1394,227 @@ int harpoon_isConnected(struct harpoon *hp)
 
 void harpoon_monitor(struct harpoon *hp)
 {
-	if (hp->device)
+	USDT2(monitor_start, hp, harpoon__isOpen(hp));
+	if (harpoon__isOpen(hp))
 	{
 		if (!harpoon_isConnected(hp))
 			harpoon_disconnect(hp);
 	}
 	else
 		harpoon_connect(hp);
+	USDT2(monitor_done, hp, harpoon__isOpen(hp));
+}
+
+int harpoon_get_pollfds(struct harpoon *hp, struct pollfd *fds, int max)
+{
+	const struct libusb_pollfd **list;
+	int n = 0;
+
+	assert(hp);
+	
+	/* libusb allocates the list, so with a private context it is
+	 * only fetched again once the notifiers say it changed
+	 */
+	if (hp->ownsContext && hp->pollfdCount >= 0)
+	{
+		n = hp->pollfdCount;
+		memcpy(fds, hp->pollfds, sizeof(*fds) * (n < max ? n : max));
+	}
+	else if ((list = libusb_get_pollfds(hp->context)))
+	{
+		for (n = 0; list[n]; ++n)
+		{
+			struct pollfd fd = { list[n]->fd, list[n]->events, 0 };
+			
+			if (n < max)
+				fds[n] = fd;
+			if (n < events_MAX_POLLFDS)
+				hp->pollfds[n] = fd;
+		}
+	
+		libusb_free_pollfds(list);
+		
+		/* kept only if all of it fit */
+		hp->pollfdCount = n <= events_MAX_POLLFDS ? n : -1;
+	}
+	
+#ifdef __linux__
+	/* the device node is writable once there are URBs to reap */
+	if (hp->usbfs >= 0)
+	{
+		if (n < max)
+		{
+			fds[n].fd = hp->usbfs;
+			fds[n].events = POLLOUT;
+			fds[n].revents = 0;
+		}
+		n += 1;
+	}
+#endif
+	
+	/* callbacks that ran on a shared context's own thread */
+	if (hp->wakeup[0] >= 0)
+	{
+		if (n < max)
+		{
+			fds[n].fd = hp->wakeup[0];
+			fds[n].events = POLLIN;
+			fds[n].revents = 0;
+		}
+		n += 1;
+	}
+	
+	return n;
+}
+
+int harpoon_get_timeout(struct harpoon *hp)
+{
+	struct timeval tv;
+	int timeout = -1;
+	
+	assert(hp);
+	
+	/* a blocking send handles libusb's events too, and may have
+	 * left these for harpoon_handle_events() to act upon
+	 */
+	if (atomic_load(&hp->arrived) || atomic_load(&hp->left) || hp->deferred
+		|| hp->finishedHead != atomic_load(&hp->finishedTail)
+	)
+		return 0;
+		
+	if (hp->monitorTime)
+	{
+		uint64_t now = harpoon__msec();
+		
+		timeout = hp->monitorTime > now ? hp->monitorTime - now : 0;
+	}
+	
+	/* a skipped color that may have been the last */
+	if (hp->hasSettle)
+	{
+		uint64_t now = harpoon__msec();
+		int settle = hp->settleTime > now ? hp->settleTime - now : 0;
+		
+		if (timeout < 0 || settle < timeout)
+			timeout = settle;
+	}
+	
+	/* libusb may have timeouts of its own to handle */
+	if (libusb_get_next_timeout(hp->context, &tv) == 1)
+	{
+		int usb = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+		
+		if (timeout < 0 || usb < timeout)
+			timeout = usb;
+	}
+	
+	return timeout;
 }
 
+int harpoon_handle_events(struct harpoon *hp, int timeout_msec)
+{
+	struct timeval tv;
+	int errcode;
+	
+	assert(hp);
+	
+#ifdef __linux__
+	/* libusb doesn't know about the device node, so wait on both here,
+	 * for no longer than libusb's own timeouts or ours allow
+	 */
+	if (hp->usbfs >= 0 && timeout_msec)
+	{
+		struct pollfd fds[events_MAX_POLLFDS];
+		int n = harpoon_get_pollfds(hp, fds, events_MAX_POLLFDS);
+		int timeout = harpoon_get_timeout(hp);
+		
+		if (timeout < 0 || (timeout_msec >= 0 && timeout_msec < timeout))
+			timeout = timeout_msec;
+		poll(fds, n < events_MAX_POLLFDS ? n : events_MAX_POLLFDS, timeout);
+		timeout_msec = 0;
+	}
+#endif
+	tv.tv_sec = timeout_msec / 1000;
+	tv.tv_usec = (timeout_msec % 1000) * 1000;
+	
+	/* libusb has no null timeout; waiting forever is its own call */
+	if (timeout_msec < 0)
+		errcode = libusb_handle_events_completed(hp->context, 0);
+	else
+		errcode = libusb_handle_events_timeout_completed(hp->context, &tv, 0);
+	if (errcode)
+		return errcode;
+		
+#ifdef __linux__
+	/* a node whose device is gone polls ready until it is closed,
+	 * so it is handled as the mouse leaving, hotplug or not
+	 */
+	if (hp->usbfs >= 0 && harpoon__usbfsReap(hp->usbfs, false) && errno == ENODEV)
+		atomic_store(&hp->left, true);
+#endif
+
+	/* whatever woke us is acted upon below, and anything
+	 * landing after this wakes the next wait instead
+	 */
+	harpoon__drainWakeup(hp);
+	
+	/* completions, now that libusb has returned */
+	harpoon__finish(hp);
+	
+	/* the restart a completed asynchronous send asked for */
+	if (hp->deferred)
+	{
+		void (*deferred)(struct harpoon *hp) = hp->deferred;
+		
+		hp->deferred = 0;
+		deferred(hp);
+	}
+	
+	/* the colors stopped on one too close to the last sent to be
+	 * seen; it still goes out, so the LED ends up where it was asked
+	 * to be; the filter forgets the last color so it lets this through,
+	 * unless a newer frame is already waiting
+	 */
+	if (hp->hasSettle && harpoon__msec() >= hp->settleTime)
+	{
+		hp->hasSettle = false;
+		if (!hp->hasCosmetic && harpoon__isOpen(hp))
+		{
+			hp->hasLastColor = false;
+			harpoon_queue(hp, harpoonPacket_color(hp->settle[0], hp->settle[1], hp->settle[2]));
+		}
+	}
+	
+	/* queued packets that found every transfer in use */
+	harpoon__pump(hp);
+	
+	if (atomic_exchange(&hp->left, false))
+	{
+		if (harpoon__isOpen(hp))
+			harpoon_disconnect(hp);
+	}
+	
+	/* a mouse that just arrived may still be starting up */
+	if (atomic_exchange(&hp->arrived, false))
+	{
+		hp->monitorTime = harpoon__msec();
+		hp->monitorRetries = monitor_RETRY_COUNT;
+	}
+	
+	if (hp->monitorTime && harpoon__msec() >= hp->monitorTime)
+	{
+		harpoon_monitor(hp);
+		
+		if (!hp->hasHotplug)
+			hp->monitorTime = harpoon__msec() + monitor_FALLBACK_MSEC;
+		else if (!harpoon__isOpen(hp) && hp->monitorRetries > 0)
+		{
+			hp->monitorRetries -= 1;
+			hp->monitorTime = harpoon__msec() + monitor_RETRY_MSEC;
+		}
+		else
+			hp->monitorTime = 0;
+	}
+	
+	return 0;
+}
@@ -6,26 +6,172 @@
  *
  */
 
+#ifndef HARPOON_H_INCLUDED
+#define HARPOON_H_INCLUDED
+
 #include <stdint.h>
 #include <stdbool.h>
+#include <poll.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 struct harpoon; /* opaque structure */
+struct harpoonCompositor; /* opaque structure */
+struct harpoonIdle; /* opaque structure */
+struct harpoonInput; /* opaque structure */
+struct libusb_context; /* from libusb.h */
 typedef uint8_t harpoonPacket;
 
+/* every packet is this many bytes long */
+#define HARPOON_PACKET_SIZE 64
+
+/* how a compositor layer combines with the layers below it */
+enum harpoonBlend
+{
+	HARPOON_BLEND_NORMAL = 0
+	, HARPOON_BLEND_ADD
+	, HARPOON_BLEND_MULTIPLY
+	, HARPOON_BLEND_SCREEN
+};
+
+/* send queue lanes; control packets never wait behind cosmetic ones */
+enum harpoonPriority
+{
+	HARPOON_PRIORITY_CONTROL = 0  /* poll rate, DPI config, mode, enabled mask */
+	, HARPOON_PRIORITY_COSMETIC   /* LED color; stale frames are dropped */
+};
+
+/* how packets reach the mouse */
+enum harpoonBackend
+{
+	HARPOON_BACKEND_LIBUSB = 0
+	, HARPOON_BACKEND_USBFS       /* Linux: straight to the kernel, bypassing libusb */
+};
+
 /* signal generation */
 const harpoonPacket *harpoonPacket_dpiconfig(uint8_t index, unsigned x, unsigned y, uint8_t r, uint8_t g, uint8_t b);
 const harpoonPacket *harpoonPacket_dpisetenabled(bool m0, bool m1, bool m2, bool m3, bool m4, bool m5);
 const harpoonPacket *harpoonPacket_color(uint8_t r, uint8_t g, uint8_t b);
 const harpoonPacket *harpoonPacket_pollrate(uint8_t msec);
 const harpoonPacket *harpoonPacket_dpimode(uint8_t index);
+enum harpoonPriority harpoonPacket_priority(const harpoonPacket *sig);
 
 void harpoon_monitor(struct harpoon *hp);
+
+/* event loop integration: wait for any of the file descriptors from
+ * harpoon_get_pollfds() (it returns how many there are, which may
+ * exceed 'max'), for at most harpoon_get_timeout() msec (-1 = forever),
+ * then call harpoon_handle_events(hp, 0); connecting, reconnecting,
+ * and async completions all happen in there
+ */
+int harpoon_get_pollfds(struct harpoon *hp, struct pollfd *fds, int max);
+int harpoon_get_timeout(struct harpoon *hp);
+int harpoon_handle_events(struct harpoon *hp, int timeout_msec);
 void harpoon_set_onConnect(struct harpoon *hp, void onConnect(void *udata), void *udata);
 void harpoon_set_onDisconnect(struct harpoon *hp, void onDisconnect(void *udata), void *udata);
 int harpoon_send(struct harpoon *hp, const harpoonPacket *sig);
+int harpoon_sendColor(struct harpoon *hp, uint8_t r, uint8_t g, uint8_t b);
+
+/* returns at once; 'onDone' runs from within harpoon_handle_events(),
+ * after libusb has returned, or as the device is closed, with 0 on
+ * success; fails (nonzero) if not connected, or if too many sends
+ * are already in flight
+ */
+int harpoon_sendAsync(struct harpoon *hp, const harpoonPacket *sig, void onDone(void *udata, int result), void *udata);
+
+/* queued packets go out asynchronously, one at a time, starting with
+ * harpoon_flush() and continuing from within harpoon_handle_events();
+ * a control packet waits behind at most the one packet already on its
+ * way, and a color frame is replaced by any newer one still queued;
+ * a poll rate change, which restarts the mouse, goes out only once
+ * everything else queued has, and counts as a control packet;
+ * flushing fails (nonzero), discarding the queue, if not connected;
+ * harpoon_pending() counts a lane's packets not yet done sending
+ */
+int harpoon_queue(struct harpoon *hp, const harpoonPacket *sig);
+int harpoon_flush(struct harpoon *hp);
+int harpoon_pending(struct harpoon *hp, enum harpoonPriority lane);
+
+/* color frames closer than 'threshold' (thousandths of an OKLab unit,
+ * ~20 is barely visible) to the last one sent are skipped, but one is
+ * always sent after 'keyframe_msec', and a skipped one that stays the
+ * newest for 250 msec goes out from harpoon_handle_events(), so a
+ * finished animation ends on its exact color; a threshold of 0
+ * disables this
+ */
+void harpoon_set_colorFilter(struct harpoon *hp, unsigned threshold, unsigned keyframe_msec);
+void harpoon_get_colorFilterStats(struct harpoon *hp, unsigned long *sent, unsigned long *skipped);
 const char *harpoon_connect(struct harpoon *hp);
 void harpoon_disconnect(struct harpoon *hp);
 int harpoon_isConnected(struct harpoon *hp);
 void harpoon_delete(struct harpoon *hp);
 struct harpoon *harpoon_new(void);
 
+/* like harpoon_new(), but returns a libusb error code instead of
+ * exiting; a non-null 'ctx' is shared rather than created, and
+ * outlives the handle; whichever thread handles its events may
+ * finish transfers, but completions and connection changes are
+ * still acted upon by harpoon_handle_events(); the handle then has
+ * a descriptor of its own among harpoon_get_pollfds(), readable
+ * whenever there is something for it to act upon
+ */
+int harpoon_new_with_context(struct harpoon **out, struct libusb_context *ctx);
+
+/* takes effect on the next harpoon_connect(); with the usbfs backend,
+ * libusb still finds the mouse and reports hotplug events, but
+ * packets are submitted and reaped through the device node itself;
+ * the HARPOON_BACKEND environment variable ("libusb" or "usbfs")
+ * sets the default; returns nonzero if unsupported on this platform
+ */
+int harpoon_set_backend(struct harpoon *hp, enum harpoonBackend backend);
+
+/* color compositor: layers are blended lowest priority first, over
+ * black; a layer with a lifetime (msec, 0 = forever) removes itself;
+ * harpoonCompositor_update() sends one color packet when the result
+ * changed, and returns msec until it should run again (-1 = only
+ * after the next change), which is soon if that packet failed to go
+ * out; call harpoonCompositor_invalidate() from onConnect so a
+ * reconnected mouse gets the current color
+ */
+struct harpoonCompositor *harpoonCompositor_new(struct harpoon *hp);
+void harpoonCompositor_delete(struct harpoonCompositor *c);
+int harpoonCompositor_set(struct harpoonCompositor *c, int id, int priority, uint32_t rgb, uint8_t alpha, enum harpoonBlend blend, unsigned lifetime_msec);
+void harpoonCompositor_remove(struct harpoonCompositor *c, int id);
+void harpoonCompositor_invalidate(struct harpoonCompositor *c);
+int harpoonCompositor_update(struct harpoonCompositor *c);
+
+/* input devices (Linux evdev), behind one descriptor that becomes
+ * readable on any event; harpoonInput_open() adds a device by path,
+ * returning nonzero (errno set) if it can't be read; harpoonInput_scan()
+ * adds every event device that has 'key' (0 = any), now and as they
+ * appear, returning nonzero if it can't watch for new ones;
+ * harpoonInput_read() drains everything, calling 'onEvent' with each
+ * event's time in nsec on the monotonic clock
+ */
+struct harpoonInput *harpoonInput_new(void);
+void harpoonInput_delete(struct harpoonInput *in);
+int harpoonInput_open(struct harpoonInput *in, const char *path);
+int harpoonInput_scan(struct harpoonInput *in, unsigned key);
+int harpoonInput_fd(struct harpoonInput *in);
+int harpoonInput_count(struct harpoonInput *in);
+void harpoonInput_read(struct harpoonInput *in, void onEvent(void *udata, unsigned type, unsigned code, int value, uint64_t nsec), void *udata);
+
+/* user idle detection, from input device activity (Linux evdev);
+ * harpoonIdle_new() returns 0 if no input device can be read;
+ * harpoonIdle_fd() becomes readable on any input, after which
+ * harpoonIdle_check() drains it and tells whether the user is idle;
+ * harpoonIdle_timeout() is msec until idle (-1 = already idle)
+ */
+struct harpoonIdle *harpoonIdle_new(unsigned timeout_msec);
+void harpoonIdle_delete(struct harpoonIdle *idle);
+int harpoonIdle_fd(struct harpoonIdle *idle);
+bool harpoonIdle_check(struct harpoonIdle *idle);
+int harpoonIdle_timeout(struct harpoonIdle *idle);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HARPOON_H_INCLUDED */
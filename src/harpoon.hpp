@@ -0,0 +1,343 @@
+/*
+ * harpoon.hpp <z64.me>
+ *
+ * C++20 coroutine wrapper around harpoon.h;
+ * sending, waiting for the mouse, and changing
+ * the poll rate suspend instead of blocking,
+ * and resume from Device::handle_events(), once
+ * harpoon_handle_events() has returned, so no
+ * coroutine ever runs from inside the library
+ *
+ * example:
+ *   harpoonpp::Task blink(harpoonpp::Device &dev)
+ *   {
+ *       co_await dev.connected();
+ *       co_await dev.send(harpoonPacket_color(255, 0, 0));
+ *       co_await dev.restart_after_pollrate(1);
+ *   }
+ *
+ */
+
+#ifndef HARPOON_HPP_INCLUDED
+#define HARPOON_HPP_INCLUDED
+
+#include <array>
+#include <coroutine>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "harpoon.h"
+}
+
+/* 'harpoon' already names the C handle's struct */
+namespace harpoonpp
+{
+
+/* a coroutine that starts at once and cleans up after itself */
+struct Task
+{
+	struct promise_type
+	{
+		Task get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+	};
+};
+
+class Device
+{
+	class Send;
+	
+	/* lives on the heap, so callbacks can find it after a move */
+	struct State
+	{
+		struct harpoon *hp = nullptr;
+		std::vector<std::pair<std::coroutine_handle<>, bool*>> connectWaiters;
+		std::vector<std::coroutine_handle<>> ready; /* resumed once the library returns */
+		std::deque<Send*> backlog; /* waiting for a free transfer */
+		std::function<void()> onConnect;
+		std::function<void()> onDisconnect;
+		
+		/* readies everyone waiting for a connection */
+		void wake(bool result)
+		{
+			auto waiters = std::move(connectWaiters);
+			
+			connectWaiters.clear();
+			for (auto &w : waiters)
+			{
+				*w.second = result;
+				ready.push_back(w.first);
+			}
+		}
+		
+		/* coroutines readied while the library was running; those
+		 * may ready more in turn
+		 */
+		void resumeReady()
+		{
+			while (!ready.empty())
+			{
+				auto now = std::move(ready);
+				
+				ready.clear();
+				for (auto h : now)
+					h.resume();
+			}
+		}
+		
+		/* sends that can no longer go through fail */
+		void failBacklog();
+		
+		static void onConnectCallback(void *udata)
+		{
+			State *s = static_cast<State*>(udata);
+			
+			if (s->onConnect)
+				s->onConnect();
+			s->wake(true);
+		}
+		
+		static void onDisconnectCallback(void *udata)
+		{
+			State *s = static_cast<State*>(udata);
+			
+			s->failBacklog();
+			if (s->onDisconnect)
+				s->onDisconnect();
+		}
+	};
+	
+	/* co_await result is 0 on success, like harpoon_send() */
+	class Send
+	{
+	public:
+		Send(State *state, const harpoonPacket *sig, int restartMsec = -1)
+			: state(state)
+			, restartMsec(restartMsec)
+		{
+			if (sig)
+				std::memcpy(packet.data(), sig, HARPOON_PACKET_SIZE);
+		}
+		
+		bool await_ready() const noexcept { return false; }
+		
+		bool await_suspend(std::coroutine_handle<> h)
+		{
+			handle = h;
+			
+			/* no free transfer; wait for one behind the others */
+			if (submit())
+			{
+				if (!state->hp || !harpoon_isConnected(state->hp))
+					return false;
+				state->backlog.push_back(this);
+			}
+			
+			return true;
+		}
+		
+		int await_resume() const noexcept { return result; }
+		bool isReconnected() const noexcept { return reconnected; }
+		
+	private:
+		friend struct State;
+		
+		State *state;
+		std::coroutine_handle<> handle;
+		std::array<harpoonPacket, HARPOON_PACKET_SIZE> packet;
+		int restartMsec;   /* a poll rate change, waits for reconnecting */
+		bool reconnected = false;
+		int result = 1;
+		
+		int submit()
+		{
+			const harpoonPacket *sig = packet.data();
+			
+			if (!state->hp)
+				return 1;
+				
+			/* built right before sending, so it keeps its
+			 * deferred reconnect even after waiting in the backlog
+			 */
+			if (restartMsec >= 0)
+				sig = harpoonPacket_pollrate(restartMsec);
+				
+			return harpoon_sendAsync(state->hp, sig, onDone, this);
+		}
+		
+		static void onDone(void *udata, int result)
+		{
+			Send *self = static_cast<Send*>(udata);
+			State *state = self->state;
+			std::vector<Send*> failed;
+			
+			/* the transfer this one used is free again */
+			while (!state->backlog.empty())
+			{
+				Send *next = state->backlog.front();
+				
+				if (next->submit())
+				{
+					if (state->hp && harpoon_isConnected(state->hp))
+						break;
+					failed.push_back(next);
+				}
+				state->backlog.pop_front();
+			}
+			
+			self->result = result;
+			
+			/* the mouse restarts; resume once it is back */
+			if (!result && self->restartMsec >= 0)
+				state->connectWaiters.emplace_back(self->handle, &self->reconnected);
+			else
+				state->ready.push_back(self->handle);
+				
+			for (Send *f : failed)
+				state->ready.push_back(f->handle);
+		}
+	};
+	
+	/* co_await result is true once the mouse is connected */
+	class Connected
+	{
+	public:
+		explicit Connected(State *state) : state(state) {}
+		
+		bool await_ready() const noexcept
+		{
+			return state->hp && harpoon_isConnected(state->hp);
+		}
+		
+		void await_suspend(std::coroutine_handle<> h)
+		{
+			state->connectWaiters.emplace_back(h, &result);
+		}
+		
+		bool await_resume() const noexcept
+		{
+			return result || await_ready();
+		}
+		
+	private:
+		State *state;
+		bool result = false;
+	};
+	
+	/* restart_after_pollrate() resumes with the reconnection's outcome */
+	class Restart
+	{
+	public:
+		Restart(State *state, int msec) : send(state, nullptr, msec) {}
+		
+		bool await_ready() const noexcept { return false; }
+		bool await_suspend(std::coroutine_handle<> h) { return send.await_suspend(h); }
+		int await_resume() const noexcept { return send.await_resume() || !send.isReconnected(); }
+		
+	private:
+		Send send;
+	};
+	
+	std::unique_ptr<State> state;
+	
+public:
+	Device()
+		: state(std::make_unique<State>())
+	{
+		state->hp = harpoon_new();
+		harpoon_set_onConnect(state->hp, State::onConnectCallback, state.get());
+		harpoon_set_onDisconnect(state->hp, State::onDisconnectCallback, state.get());
+	}
+	
+	~Device()
+	{
+		struct harpoon *hp;
+		
+		if (!state)
+			return;
+			
+		/* transfers in flight are cancelled, and their coroutines
+		 * resume with an error; so do those waiting to connect
+		 */
+		hp = state->hp;
+		harpoon_delete(hp);
+		state->hp = nullptr;
+		state->failBacklog();
+		state->wake(false);
+		state->resumeReady();
+	}
+	
+	Device(Device &&) noexcept = default;
+	Device &operator=(Device &&other) noexcept
+	{
+		Device tmp(std::move(other));
+		
+		std::swap(state, tmp.state);
+		
+		return *this;
+	}
+	Device(const Device &) = delete;
+	Device &operator=(const Device &) = delete;
+	
+	/* the wrapped handle, for anything not covered here */
+	struct harpoon *get() const noexcept { return state->hp; }
+	
+	/* coroutines waiting for the connection resume
+	 * from the next handle_events(), not from in here
+	 */
+	const char *connect() { return harpoon_connect(state->hp); }
+	void disconnect() { harpoon_disconnect(state->hp); }
+	bool isConnected() const { return harpoon_isConnected(state->hp); }
+	
+	void set_onConnect(std::function<void()> f) { state->onConnect = std::move(f); }
+	void set_onDisconnect(std::function<void()> f) { state->onDisconnect = std::move(f); }
+	
+	/* the event loop drives every suspended coroutine */
+	int pollfds(struct pollfd *fds, int max) { return harpoon_get_pollfds(state->hp, fds, max); }
+	int timeout() { return state->ready.empty() ? harpoon_get_timeout(state->hp) : 0; }
+	int handle_events(int timeout_msec = 0)
+	{
+		int rval = harpoon_handle_events(state->hp, state->ready.empty() ? timeout_msec : 0);
+		
+		state->resumeReady();
+		
+		return rval;
+	}
+	
+	/* the packet is copied, so it may be reused right away;
+	 * poll rate changes belong in restart_after_pollrate()
+	 */
+	Send send(const harpoonPacket *sig) { return Send(state.get(), sig); }
+	
+	Connected connected() { return Connected(state.get()); }
+	
+	/* sends the new poll rate, and resumes once the mouse
+	 * has restarted and reconnected; 0 on success
+	 */
+	Restart restart_after_pollrate(uint8_t msec) { return Restart(state.get(), msec); }
+};
+
+inline void Device::State::failBacklog()
+{
+	auto failed = std::move(backlog);
+	
+	backlog.clear();
+	for (Send *s : failed)
+	{
+		s->result = 1;
+		ready.push_back(s->handle);
+	}
+}
+
+}
+
+#endif /* HARPOON_HPP_INCLUDED */
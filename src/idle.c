@@ -0,0 +1,405 @@
+/*
+ * idle.c <z64.me>
+ *
+ * watches input devices for events; for noticing
+ * when nobody is using the computer, so animations
+ * can stop when they are unseen, and for programs
+ * that act upon a key or button
+ *
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <linux/input.h>
+
+#include "harpoon.h"
+
+#define INPUT_DIR "/dev/input"
+#define DEVICE_MAX 64
+
+#define BITS_PER_LONG (8 * sizeof(long))
+
+struct harpoonInput
+{
+	int epoll;
+	int inotify;          /* new input devices; -1 = not scanning */
+	unsigned key;         /* scanned devices must have it; 0 = any */
+	int device[DEVICE_MAX];
+	dev_t rdev[DEVICE_MAX]; /* so a device is only opened once */
+	int devices;
+};
+
+struct harpoonIdle
+{
+	struct harpoonInput *input;
+	unsigned timeout;     /* msec */
+	uint64_t lastInput;   /* msec on the monotonic clock */
+};
+
+/*
+ *
+ * private
+ *
+ */
+
+/* milliseconds on the monotonic clock */
+static uint64_t idle__msec(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec * 1000ull + ts.tv_nsec / 1000000;
+}
+
+/* start watching one event device; 'any' skips the key check;
+ * returns nonzero, with errno set, if it can't be read
+ */
+static int input__open(struct harpoonInput *in, const char *path, bool any)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	unsigned long bits[KEY_MAX / BITS_PER_LONG + 1] = {0};
+	struct stat st;
+	int clock = CLOCK_MONOTONIC;
+	int fd;
+	int i;
+	
+	if (in->devices == DEVICE_MAX)
+	{
+		errno = EMFILE;
+		return 1;
+	}
+	
+	if ((fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+		return 1;
+		
+	/* a new device is announced more than once, and
+	 * permission changes announce devices already open
+	 */
+	if (fstat(fd, &st))
+		st.st_rdev = 0;
+	for (i = 0; st.st_rdev && i < in->devices; ++i)
+	{
+		if (in->rdev[i] == st.st_rdev)
+		{
+			close(fd);
+			return 0;
+		}
+	}
+	
+	/* only devices that have the key are worth a descriptor */
+	if (!any
+		&& in->key
+		&& (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(bits)), bits) < 0
+			|| !(bits[in->key / BITS_PER_LONG] & (1ul << (in->key % BITS_PER_LONG)))
+		)
+	)
+	{
+		close(fd);
+		return 0;
+	}
+	
+	/* event timestamps then compare against the monotonic clock */
+	ioctl(fd, EVIOCSCLOCKID, &clock);
+	
+	ev.data.fd = fd;
+	if (epoll_ctl(in->epoll, EPOLL_CTL_ADD, fd, &ev))
+	{
+		close(fd);
+		return 1;
+	}
+	in->device[in->devices] = fd;
+	in->rdev[in->devices] = st.st_rdev;
+	in->devices += 1;
+	
+	return 0;
+}
+
+/* a device in INPUT_DIR, if it is an event device */
+static void input__openName(struct harpoonInput *in, const char *name)
+{
+	char path[sizeof(INPUT_DIR) + NAME_MAX + 1];
+	
+	if (strncmp(name, "event", 5))
+		return;
+		
+	snprintf(path, sizeof(path), INPUT_DIR "/%s", name);
+	input__open(in, path, false);
+}
+		
+static void input__forget(struct harpoonInput *in, int fd)
+{
+	int i;
+	
+	epoll_ctl(in->epoll, EPOLL_CTL_DEL, fd, 0);
+	close(fd);
+	for (i = 0; i < in->devices; ++i)
+	{
+		if (in->device[i] != fd)
+			continue;
+			
+		in->devices -= 1;
+		in->device[i] = in->device[in->devices];
+		in->rdev[i] = in->rdev[in->devices];
+		break;
+	}
+}
+	
+/* open devices that appeared since the last check */
+static void input__scanNew(struct harpoonInput *in)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	char *p;
+	
+	while ((len = read(in->inotify, buf, sizeof(buf))) > 0)
+	{
+		for (p = buf; p < buf + len; )
+		{
+			const struct inotify_event *ev = (void*)p;
+			
+			/* permissions may only allow reading a moment later */
+			if (ev->len)
+				input__openName(in, ev->name);
+				
+			p += sizeof(*ev) + ev->len;
+		}
+	}
+}
+
+/* read everything a device has queued */
+static void input__drain(struct harpoonInput *in, int fd, void onEvent(void *udata, unsigned type, unsigned code, int value, uint64_t nsec), void *udata)
+{
+	struct input_event buf[64];
+	ssize_t len;
+	int i;
+	
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+	{
+		int n = len / sizeof(*buf);
+		
+		for (i = 0; i < n; ++i)
+			onEvent(udata, buf[i].type, buf[i].code, buf[i].value
+				, buf[i].input_event_sec * 1000000000ull
+					+ buf[i].input_event_usec * 1000ull
+			);
+	}
+	
+	/* the device was unplugged, or a named file ended */
+	if (!len || (len < 0 && errno == ENODEV))
+		input__forget(in, fd);
+}
+
+/* the newest input event is what idleness is measured from */
+static void idle__onEvent(void *udata, unsigned type, unsigned code, int value, uint64_t nsec)
+{
+	struct harpoonIdle *idle = udata;
+	uint64_t now = idle__msec();
+	uint64_t t = nsec / 1000000;
+			
+	/* in case the clock could not be switched */
+	if (t > now)
+		t = now;
+				
+	if (type != EV_SYN && t > idle->lastInput)
+		idle->lastInput = t;
+	
+	(void)code;
+	(void)value;
+}
+
+/*
+ *
+ * public
+ *
+ */
+
+struct harpoonInput *harpoonInput_new(void)
+{
+	struct harpoonInput *in;
+	
+	if (!(in = calloc(1, sizeof(*in))))
+		return 0;
+		
+	in->inotify = -1;
+	if ((in->epoll = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	{
+		free(in);
+		return 0;
+	}
+	
+	return in;
+}
+
+void harpoonInput_delete(struct harpoonInput *in)
+{
+	int i;
+	
+	if (!in)
+		return;
+		
+	for (i = 0; i < in->devices; ++i)
+		close(in->device[i]);
+	if (in->inotify >= 0)
+		close(in->inotify);
+	close(in->epoll);
+	
+	free(in);
+}
+
+int harpoonInput_open(struct harpoonInput *in, const char *path)
+{
+	assert(in);
+	assert(path);
+	
+	return input__open(in, path, true);
+}
+
+int harpoonInput_scan(struct harpoonInput *in, unsigned key)
+{
+	struct epoll_event ev = { .events = EPOLLIN };
+	struct dirent *ent;
+	DIR *dir;
+	int rval = 0;
+	
+	assert(in);
+	
+	in->key = key;
+	
+	/* watch for devices plugged in later */
+	if (in->inotify < 0)
+	{
+		if ((in->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+			rval = 1;
+		else if (inotify_add_watch(in->inotify, INPUT_DIR, IN_CREATE | IN_ATTRIB) < 0)
+		{
+			close(in->inotify);
+			in->inotify = -1;
+			rval = 1;
+		}
+		else
+		{
+			ev.data.fd = in->inotify;
+			epoll_ctl(in->epoll, EPOLL_CTL_ADD, in->inotify, &ev);
+		}
+	}
+	
+	if ((dir = opendir(INPUT_DIR)))
+	{
+		while ((ent = readdir(dir)))
+			input__openName(in, ent->d_name);
+		closedir(dir);
+	}
+	
+	return rval;
+}
+
+int harpoonInput_fd(struct harpoonInput *in)
+{
+	assert(in);
+	
+	return in->epoll;
+}
+
+int harpoonInput_count(struct harpoonInput *in)
+{
+	assert(in);
+	
+	return in->devices;
+}
+
+void harpoonInput_read(struct harpoonInput *in, void onEvent(void *udata, unsigned type, unsigned code, int value, uint64_t nsec), void *udata)
+{
+	struct epoll_event ev[16];
+	int n;
+	int i;
+	
+	assert(in);
+	assert(onEvent);
+	
+	while ((n = epoll_wait(in->epoll, ev, 16, 0)) > 0)
+	{
+		for (i = 0; i < n; ++i)
+		{
+			if (ev[i].data.fd == in->inotify)
+				input__scanNew(in);
+			else
+				input__drain(in, ev[i].data.fd, onEvent, udata);
+		}
+		
+		if (n < 16)
+			break;
+	}
+}
+
+struct harpoonIdle *harpoonIdle_new(unsigned timeout_msec)
+{
+	struct harpoonIdle *idle;
+	
+	if (!(idle = calloc(1, sizeof(*idle))))
+		return 0;
+		
+	idle->timeout = timeout_msec;
+	idle->lastInput = idle__msec();
+	
+	/* without any readable device, idleness can't be told */
+	if (!(idle->input = harpoonInput_new()))
+		goto L_fail;
+	harpoonInput_scan(idle->input, 0);
+	if (!harpoonInput_count(idle->input))
+		goto L_fail;
+		
+	return idle;
+	
+L_fail:
+	harpoonIdle_delete(idle);
+	return 0;
+}
+
+void harpoonIdle_delete(struct harpoonIdle *idle)
+{
+	if (!idle)
+		return;
+		
+	harpoonInput_delete(idle->input);
+	free(idle);
+}
+
+int harpoonIdle_fd(struct harpoonIdle *idle)
+{
+	assert(idle);
+	
+	return harpoonInput_fd(idle->input);
+}
+
+bool harpoonIdle_check(struct harpoonIdle *idle)
+{
+	assert(idle);
+	
+	harpoonInput_read(idle->input, idle__onEvent, idle);
+	
+	return idle__msec() - idle->lastInput >= idle->timeout;
+}
+
+int harpoonIdle_timeout(struct harpoonIdle *idle)
+{
+	uint64_t since;
+	
+	assert(idle);
+	
+	since = idle__msec() - idle->lastInput;
+	
+	return since >= idle->timeout ? -1 : (int)(idle->timeout - since);
+}
@@ -0,0 +1,337 @@
+/*
+ * load.c <z64.me>
+ *
+ * shows how busy the computer is on the mouse's
+ * LED, from green (idle) to red (CPU or memory
+ * exhausted), while costing as little as possible
+ *
+ * nothing is allocated once running, save by libusb
+ * as it submits each packet, which happens only when
+ * the color changes: /proc files stay open and are
+ * re-read into fixed buffers, and harpoon keeps
+ * libusb's descriptor list until libusb changes it
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "harpoon.h"
+
+#define MAX_POLLFDS 16
+
+/* how long the sample interval may stretch to stay under budget */
+#define INTERVAL_MAX_MSEC 10000
+
+/* how often the sampler's own CPU use is checked, and reported */
+#define COST_WINDOW_MSEC 10000
+
+struct sampler
+{
+	int stat;          /* /proc/stat */
+	int meminfo;       /* /proc/meminfo */
+	char buf[4096];    /* only the start of each file is needed */
+	uint64_t busy;     /* previous /proc/stat totals, in jiffies */
+	uint64_t total;
+	uint8_t gradient[256][3];
+	int sent;          /* gradient index shown; -1 = none yet */
+	unsigned long packets;
+};
+
+/* fatal error message */
+static void die(const char *fmt, ...)
+{
+	va_list ap;
+	
+	if (!fmt)
+		exit(EXIT_FAILURE);
+		
+	fprintf(stderr, "[!] ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	
+	exit(EXIT_FAILURE);
+}
+
+static void showargs(void)
+{
+#define P(X) fprintf(stderr, X "\n")
+	P("  -i, --interval  milliseconds between samples (default 500)");
+	P("  -l, --levels    distinct colors from green to red (default 16)");
+	P("  -b, --budget    CPU microseconds per second the sampler may use (default 1000)");
+	P("  -q, --quiet     0 or 1; 1 skips the periodic cost report (default 0)");
+#undef P
+	exit(EXIT_FAILURE);
+}
+
+/* nanoseconds on the given clock */
+static uint64_t now_nsec(clockid_t clock)
+{
+	struct timespec ts;
+	
+	clock_gettime(clock, &ts);
+	
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* read the decimal number at or after 's', stopping at the line's end */
+static const char *parse_u64(const char *s, uint64_t *out)
+{
+	uint64_t v = 0;
+	
+	while (*s == ' ' || *s == '\t')
+		++s;
+		
+	if (*s < '0' || *s > '9')
+		return 0;
+		
+	while (*s >= '0' && *s <= '9')
+		v = v * 10 + (*s++ - '0');
+		
+	*out = v;
+	
+	return s;
+}
+
+/* the start of the line after 's', or 0 */
+static const char *next_line(const char *s)
+{
+	while (*s && *s != '\n')
+		++s;
+		
+	return *s ? s + 1 : 0;
+}
+
+/* re-read an open /proc file into the shared buffer */
+static bool sampler_read(struct sampler *s, int fd)
+{
+	ssize_t len = pread(fd, s->buf, sizeof(s->buf) - 1, 0);
+	
+	if (len <= 0)
+		return false;
+		
+	s->buf[len] = '\0';
+	
+	return true;
+}
+
+/* fraction of CPU time spent busy since the last call, 0 - 255 */
+static int sampler_cpu(struct sampler *s)
+{
+	const char *p = s->buf;
+	uint64_t v[8] = {0};
+	uint64_t busy;
+	uint64_t total = 0;
+	uint64_t dBusy;
+	uint64_t dTotal;
+	int i;
+	
+	/* cpu  user nice system idle iowait irq softirq steal */
+	if (!sampler_read(s, s->stat) || strncmp(p, "cpu ", 4))
+		return 0;
+	p += 4;
+	for (i = 0; i < 8 && p; ++i)
+	{
+		if ((p = parse_u64(p, &v[i])))
+			total += v[i];
+	}
+	busy = total - v[3] - v[4]; /* waiting on a disk is idle too */
+	
+	dBusy = busy - s->busy;
+	dTotal = total - s->total;
+	s->busy = busy;
+	s->total = total;
+	
+	if (!dTotal || dBusy > dTotal)
+		return 0;
+		
+	return dBusy * 255 / dTotal;
+}
+
+/* fraction of memory not available to programs, 0 - 255 */
+static int sampler_mem(struct sampler *s)
+{
+	const char *p = s->buf;
+	uint64_t total = 0;
+	uint64_t avail = 0;
+	
+	if (!sampler_read(s, s->meminfo))
+		return 0;
+		
+	for ( ; p && (!total || !avail); p = next_line(p))
+	{
+		if (!strncmp(p, "MemTotal:", 9))
+			parse_u64(p + 9, &total);
+		else if (!strncmp(p, "MemAvailable:", 13))
+			parse_u64(p + 13, &avail);
+	}
+	
+	if (!total || avail > total)
+		return 0;
+		
+	return (total - avail) * 255 / total;
+}
+
+/* green through yellow to red, in 'levels' steps */
+static void sampler_buildGradient(struct sampler *s, int levels)
+{
+	int i;
+	
+	for (i = 0; i < 256; ++i)
+	{
+		int step = (i * (levels - 1) + 127) / 255;
+		int v = step * 510 / (levels - 1);
+		
+		s->gradient[i][0] = v > 255 ? 255 : v;
+		s->gradient[i][1] = v < 255 ? 255 : 510 - v;
+		s->gradient[i][2] = 0;
+	}
+}
+
+/* take one sample, and send its color if that differs from the last */
+static void sampler_update(struct sampler *s, struct harpoon *hp)
+{
+	int cpu = sampler_cpu(s);
+	int mem = sampler_mem(s);
+	int index = cpu > mem ? cpu : mem;
+	const uint8_t *rgb = s->gradient[index];
+	
+	/* neighbouring levels often share a color */
+	if (s->sent >= 0 && !memcmp(rgb, s->gradient[s->sent], 3))
+		return;
+		
+	if (!harpoon_isConnected(hp)
+		|| harpoon_sendColor(hp, rgb[0], rgb[1], rgb[2])
+	)
+		return;
+		
+	s->sent = index;
+	s->packets += 1;
+}
+
+static void onConnect(void *udata)
+{
+	struct sampler *s = udata;
+	
+	/* the mouse may have restarted with another color */
+	s->sent = -1;
+}
+
+int main(int argc, char *argv[])
+{
+	static struct sampler s;
+	struct harpoon *hp;
+	unsigned interval = 500;
+	unsigned budget = 1000;
+	unsigned current;
+	int levels = 16;
+	int quiet = 0;
+	uint64_t nextSample;
+	uint64_t windowStart;
+	uint64_t windowCpu;
+	int i;
+	
+	/* step through arguments */
+	for (i = 1; i < argc; i += 2)
+	{
+#define ARGMATCH(ALIAS, NAME) (!strcasecmp(this, "-" ALIAS) \
+	|| !strcasecmp(this, "--" NAME))
+		const char *this = argv[i];
+		const char *param = argv[i + 1];
+		
+		if (!param)
+			showargs();
+			
+		if (ARGMATCH("i", "interval"))
+			interval = strtoul(param, 0, 0);
+		else if (ARGMATCH("l", "levels"))
+			levels = strtol(param, 0, 0);
+		else if (ARGMATCH("b", "budget"))
+			budget = strtoul(param, 0, 0);
+		else if (ARGMATCH("q", "quiet"))
+			quiet = strtol(param, 0, 0);
+		else
+			showargs();
+#undef ARGMATCH
+	}
+	if (!interval || interval > INTERVAL_MAX_MSEC || levels < 2 || levels > 256 || !budget)
+		die("invalid arguments");
+		
+	if ((s.stat = open("/proc/stat", O_RDONLY | O_CLOEXEC)) < 0
+		|| (s.meminfo = open("/proc/meminfo", O_RDONLY | O_CLOEXEC)) < 0
+	)
+		die("failed to open /proc/stat and /proc/meminfo");
+	sampler_buildGradient(&s, levels);
+	sampler_cpu(&s); /* the first difference starts from here */
+	s.sent = -1;
+	
+	hp = harpoon_new();
+	harpoon_set_onConnect(hp, onConnect, &s);
+	harpoon_connect(hp); /* or once it is plugged in */
+	
+	current = interval;
+	nextSample = now_nsec(CLOCK_MONOTONIC) + current * 1000000ull;
+	windowStart = now_nsec(CLOCK_MONOTONIC);
+	windowCpu = now_nsec(CLOCK_PROCESS_CPUTIME_ID);
+	
+	while (1)
+	{
+		struct pollfd fds[MAX_POLLFDS];
+		uint64_t now = now_nsec(CLOCK_MONOTONIC);
+		int timeout = now < nextSample ? (nextSample - now + 999999) / 1000000 : 0;
+		int hpTimeout = harpoon_get_timeout(hp);
+		int n;
+		
+		/* sleep until the next sample, or whatever libusb needs */
+		if (hpTimeout >= 0 && hpTimeout < timeout)
+			timeout = hpTimeout;
+		n = harpoon_get_pollfds(hp, fds, MAX_POLLFDS);
+		if (n > MAX_POLLFDS)
+			n = MAX_POLLFDS;
+		poll(fds, n, timeout);
+		harpoon_handle_events(hp, 0);
+		
+		if ((now = now_nsec(CLOCK_MONOTONIC)) < nextSample)
+			continue;
+			
+		sampler_update(&s, hp);
+		nextSample += current * 1000000ull;
+		if (nextSample < now)
+			nextSample = now + current * 1000000ull;
+			
+		/* keep the sampler's own CPU use under budget */
+		if (now - windowStart >= COST_WINDOW_MSEC * 1000000ull)
+		{
+			uint64_t cpu = now_nsec(CLOCK_PROCESS_CPUTIME_ID);
+			double cost = (cpu - windowCpu) / 1000.0 / ((now - windowStart) / 1e9);
+			unsigned was = current;
+			
+			/* back off when over, recover when well under */
+			if (cost > budget && current < INTERVAL_MAX_MSEC)
+				current = current * 2 > INTERVAL_MAX_MSEC ? INTERVAL_MAX_MSEC : current * 2;
+			else if (cost * 4 < budget && current > interval)
+				current = current / 2 < interval ? interval : current / 2;
+				
+			if (!quiet || current != was)
+				fprintf(stderr, "cost %.1f us/s (budget %u), %lu packet(s), sampling every %u ms\n"
+					, cost, budget, s.packets, current
+				);
+				
+			windowStart = now;
+			windowCpu = cpu;
+		}
+	}
+	
+	harpoon_delete(hp);
+	
+	return 0;
+}
@@ -11,6 +11,8 @@
 
 #include "harpoon.h"
 
+#define MAX_POLLFDS 16
+
 static void onConnect(void *udata)
 {
 	struct harpoon *hp = udata;
@@ -55,10 +57,18 @@ int main(void)
 	harpoon_set_onDisconnect(hp, onDisconnect, hp);
 	harpoon_set_onConnect(hp, onConnect, hp);
 	
+	/* sleep until libusb has something to say */
 	while (1)
 	{
-		system("sleep 0.1s");
-		harpoon_monitor(hp);
+		struct pollfd fds[MAX_POLLFDS];
+		int n;
+		
+		n = harpoon_get_pollfds(hp, fds, MAX_POLLFDS);
+		if (n > MAX_POLLFDS)
+			n = MAX_POLLFDS;
+			
+		poll(fds, n, harpoon_get_timeout(hp));
+		harpoon_handle_events(hp, 0);
 	}
 	
 	harpoon_delete(hp);
@@ -0,0 +1,431 @@
+/*
+ * play.c <z64.me>
+ *
+ * plays a pre-rendered color animation file,
+ * sending each frame at its timestamp
+ *
+ * the file is memory mapped and read front to back,
+ * and pages already played are dropped, so memory
+ * use stays the same however long the file is
+ *
+ * file format (.hrpa), little endian:
+ *   header, 16 bytes:
+ *     char     magic[4]     "HRPA"
+ *     uint32   frames       how many follow the header
+ *     uint32   duration     msec; a loop restarts after this long
+ *     uint32   reserved     0
+ *   frame, 8 bytes each, timestamps never decreasing:
+ *     uint32   msec         from the start of the animation
+ *     uint8    r, g, b
+ *     uint8    pad          0
+ *
+ * --pack converts text, one frame per line, to that format:
+ *   0 0xff0000                (msec 0xHexColor)
+ *   16 0xfe0100
+ *   end 60000                 (duration; default is the last timestamp)
+ *   # comment
+ *
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "harpoon.h"
+
+#define MAX_POLLFDS 16
+
+#define HEADER_SIZE 16
+#define FRAME_SIZE  8
+
+/* played pages are dropped this many bytes at a time */
+#define DROP_BYTES (1 << 20)
+
+struct animation
+{
+	const uint8_t *map;
+	size_t mapSize;
+	const uint8_t *frame;   /* the first frame */
+	uint32_t frames;
+	uint32_t duration;
+	size_t dropped;         /* bytes already given back, from the start */
+};
+
+struct playback
+{
+	unsigned long sent;
+	unsigned long late;     /* skipped, as the next frame was already due */
+	unsigned long repeated; /* skipped, as the color was already showing */
+	uint64_t maxLate;       /* nsec a sent frame was behind its timestamp */
+};
+
+/* fatal error message */
+static void die(const char *fmt, ...)
+{
+	va_list ap;
+	
+	if (!fmt)
+		exit(EXIT_FAILURE);
+		
+	fprintf(stderr, "[!] ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	
+	exit(EXIT_FAILURE);
+}
+
+static void showargs(void)
+{
+#define P(X) fprintf(stderr, X "\n")
+	P("usage: harpoon-play [options] animation.hrpa");
+	P("       harpoon-play --pack frames.txt animation.hrpa");
+	P("  -s, --seek      start the first loop this many milliseconds in (default 0)");
+	P("  -l, --loop      play this many times, each after the first from the");
+	P("                  beginning; 0 = forever (default 1)");
+	P("  -x, --speed     playback speed multiplier (default 1)");
+#undef P
+	exit(EXIT_FAILURE);
+}
+
+/* nanoseconds on the monotonic clock */
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t get_u32(const uint8_t *b)
+{
+	return b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24;
+}
+
+static void put_u32(uint8_t *b, uint32_t v)
+{
+	b[0] = v;
+	b[1] = v >> 8;
+	b[2] = v >> 16;
+	b[3] = v >> 24;
+}
+
+/* convert a text frame list to an animation file */
+static void pack(const char *inPath, const char *outPath)
+{
+	uint8_t header[HEADER_SIZE] = { 'H', 'R', 'P', 'A' };
+	char line[256];
+	FILE *in;
+	FILE *out;
+	uint32_t frames = 0;
+	uint32_t last = 0;
+	uint32_t duration = 0;
+	int lineno = 0;
+	
+	if (!(in = fopen(inPath, "r")))
+		die("failed to open '%s' for reading", inPath);
+	if (!(out = fopen(outPath, "wb")))
+		die("failed to open '%s' for writing", outPath);
+		
+	/* the header is rewritten once the frame count is known */
+	fwrite(header, 1, sizeof(header), out);
+	
+	while (fgets(line, sizeof(line), in))
+	{
+		uint8_t frame[FRAME_SIZE] = {0};
+		const char *p = line + strspn(line, " \t\r\n");
+		unsigned long msec;
+		unsigned int color;
+		
+		lineno += 1;
+		
+		/* blank lines and comments */
+		if (!*p || *p == '#')
+			continue;
+			
+		if (sscanf(p, "end %lu", &msec) == 1)
+		{
+			if (msec > UINT32_MAX)
+				die("%s:%d: the end must be at most %lu ms", inPath, lineno, (unsigned long)UINT32_MAX);
+			duration = msec;
+			continue;
+		}
+		if (sscanf(p, "%lu %x", &msec, &color) != 2)
+			die("%s:%d: expecting 'msec 0xHexColor'", inPath, lineno);
+		if (msec < last || msec > UINT32_MAX || color > 0xffffff)
+			die("%s:%d: timestamps must not decrease, colors must be < 0xffffff", inPath, lineno);
+			
+		put_u32(frame, msec);
+		frame[4] = color >> 16;
+		frame[5] = color >> 8;
+		frame[6] = color;
+		fwrite(frame, 1, sizeof(frame), out);
+		frames += 1;
+		last = msec;
+	}
+	
+	if (duration < last)
+		duration = last;
+	put_u32(header + 4, frames);
+	put_u32(header + 8, duration);
+	if (fseek(out, 0, SEEK_SET)
+		|| fwrite(header, 1, sizeof(header), out) != sizeof(header)
+		|| fclose(out)
+	)
+		die("failed to write '%s'", outPath);
+	fclose(in);
+	
+	fprintf(stderr, "packed %u frame(s), %u ms\n", frames, duration);
+}
+
+static void animation_open(struct animation *a, const char *path)
+{
+	struct stat st;
+	int fd;
+	
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &st))
+		die("failed to open '%s'", path);
+	if (st.st_size < HEADER_SIZE)
+		die("'%s' is not an animation file", path);
+		
+	a->mapSize = st.st_size;
+	if ((a->map = mmap(0, a->mapSize, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+		die("failed to map '%s'", path);
+	close(fd);
+	
+	/* read ahead, and let played pages go sooner */
+	madvise((void*)a->map, a->mapSize, MADV_SEQUENTIAL);
+	
+	if (memcmp(a->map, "HRPA", 4))
+		die("'%s' is not an animation file", path);
+	a->frames = get_u32(a->map + 4);
+	a->duration = get_u32(a->map + 8);
+	a->frame = a->map + HEADER_SIZE;
+	if ((a->mapSize - HEADER_SIZE) / FRAME_SIZE < a->frames)
+		die("'%s' is truncated", path);
+}
+
+static uint32_t animation_time(const struct animation *a, uint32_t index)
+{
+	return get_u32(a->frame + index * FRAME_SIZE);
+}
+
+/* index of the first frame at or after 'msec' */
+static uint32_t animation_seek(const struct animation *a, uint32_t msec)
+{
+	uint32_t lo = 0;
+	uint32_t hi = a->frames;
+	
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		
+		if (animation_time(a, mid) < msec)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	
+	return lo;
+}
+
+/* give back the pages before frame 'index'; restarting resets this */
+static void animation_drop(struct animation *a, uint32_t index)
+{
+	size_t offset = HEADER_SIZE + (size_t)index * FRAME_SIZE;
+	
+	if (offset < a->dropped)
+		a->dropped = 0;
+		
+	if (offset - a->dropped < DROP_BYTES * 2)
+		return;
+		
+	/* another loop reads them back in from the file */
+	offset = (offset - DROP_BYTES) & ~(size_t)(DROP_BYTES - 1);
+	madvise((void*)a->map, offset, MADV_DONTNEED);
+	a->dropped = offset;
+}
+
+/* run the event loop until 'nsec' on the monotonic clock */
+static void wait_until(struct harpoon *hp, uint64_t nsec)
+{
+	uint64_t now;
+	
+	while ((now = now_nsec()) < nsec)
+	{
+		struct pollfd fds[MAX_POLLFDS];
+		struct timespec ts;
+		int hpTimeout = harpoon_get_timeout(hp);
+		uint64_t wait = nsec - now;
+		int n;
+		
+		if (hpTimeout >= 0 && hpTimeout * 1000000ull < wait)
+			wait = hpTimeout * 1000000ull;
+		ts.tv_sec = wait / 1000000000;
+		ts.tv_nsec = wait % 1000000000;
+		
+		n = harpoon_get_pollfds(hp, fds, MAX_POLLFDS);
+		if (n > MAX_POLLFDS)
+			n = MAX_POLLFDS;
+		ppoll(fds, n, &ts, 0);
+		harpoon_handle_events(hp, 0);
+	}
+}
+
+/* play from the first frame at or after msec 'origin', which is due at 'start' */
+static void play(struct animation *a, struct playback *pb, struct harpoon *hp, uint32_t origin, uint64_t start, double speed)
+{
+	uint32_t index = animation_seek(a, origin);
+	double scale = 1000000 / speed; /* animation msec to playback nsec */
+	uint8_t shown[3];
+	bool hasShown = false;
+	
+	/* the pages the search touched along the way */
+	madvise((void*)a->map, a->mapSize, MADV_DONTNEED);
+	a->dropped = 0;
+	
+	while (index < a->frames)
+	{
+		const uint8_t *f;
+		uint64_t due;
+		uint64_t now = now_nsec();
+		
+		/* a frame whose successor is already due is never seen */
+		while (index + 1 < a->frames
+			&& start + (animation_time(a, index + 1) - origin) * scale <= now
+		)
+		{
+			index += 1;
+			pb->late += 1;
+		}
+		f = a->frame + index * FRAME_SIZE;
+		due = start + (get_u32(f) - origin) * scale;
+		
+		wait_until(hp, due);
+		
+		if (hasShown && !memcmp(shown, f + 4, 3))
+			pb->repeated += 1;
+		else if (harpoon_isConnected(hp)
+			&& !harpoon_send(hp, harpoonPacket_color(f[4], f[5], f[6]))
+		)
+		{
+			if ((now = now_nsec() - due) > pb->maxLate)
+				pb->maxLate = now;
+			pb->sent += 1;
+			memcpy(shown, f + 4, 3);
+			hasShown = true;
+		}
+		
+		index += 1;
+		animation_drop(a, index);
+	}
+}
+
+static void onConnect(void *udata)
+{
+	(void)udata;
+	
+	fprintf(stderr, "onConnect\n");
+}
+
+static void onDisconnect(void *udata)
+{
+	(void)udata;
+	
+	fprintf(stderr, "onDisconnect\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct animation a = {0};
+	struct playback pb = {0};
+	struct rusage ru;
+	struct harpoon *hp;
+	const char *errstr;
+	const char *path;
+	unsigned long seek = 0;
+	unsigned long loops = 1;
+	unsigned long loop;
+	double speed = 1;
+	uint64_t start;
+	int i;
+	
+	if (argc == 4 && (!strcasecmp(argv[1], "--pack") || !strcasecmp(argv[1], "-p")))
+	{
+		pack(argv[2], argv[3]);
+		return 0;
+	}
+	
+	/* step through arguments; the file comes last */
+	if (argc < 2 || (argc & 1))
+		showargs();
+	for (i = 1; i < argc - 1; i += 2)
+	{
+#define ARGMATCH(ALIAS, NAME) (!strcasecmp(this, "-" ALIAS) \
+	|| !strcasecmp(this, "--" NAME))
+		const char *this = argv[i];
+		const char *param = argv[i + 1];
+		
+		if (ARGMATCH("s", "seek"))
+			seek = strtoul(param, 0, 0);
+		else if (ARGMATCH("l", "loop"))
+			loops = strtoul(param, 0, 0);
+		else if (ARGMATCH("x", "speed"))
+			speed = strtod(param, 0);
+		else
+			showargs();
+#undef ARGMATCH
+	}
+	path = argv[argc - 1];
+	if (speed <= 0 || seek > UINT32_MAX)
+		die("invalid arguments");
+		
+	animation_open(&a, path);
+	if (!a.frames)
+		die("'%s' has no frames", path);
+		
+	hp = harpoon_new();
+	harpoon_set_onDisconnect(hp, onDisconnect, 0);
+	harpoon_set_onConnect(hp, onConnect, 0);
+	if ((errstr = harpoon_connect(hp)))
+		die("%s", errstr);
+		
+	/* one timeline for every loop, so drift never builds up; a seek
+	 * skips into the first loop only, and the rest play in full, as
+	 * a loop restarts the animation rather than the seek
+	 */
+	start = now_nsec();
+	for (loop = 0; !loops || loop < loops; ++loop)
+	{
+		uint32_t origin = loop ? 0 : seek;
+		
+		play(&a, &pb, hp, origin, start, speed);
+		if (a.duration > origin)
+			start += (a.duration - origin) * (1000000 / speed);
+		else
+			start = now_nsec();
+	}
+	
+	getrusage(RUSAGE_SELF, &ru);
+	fprintf(stderr, "%lu frame(s) sent, %lu late, %lu repeated; at most %.3f ms behind; peak memory %ld KiB\n"
+		, pb.sent, pb.late, pb.repeated, pb.maxLate / 1e6, ru.ru_maxrss
+	);
+	
+	harpoon_delete(hp);
+	munmap((void*)a.map, a.mapSize);
+	
+	return 0;
+}
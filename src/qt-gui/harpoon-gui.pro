@@ -14,7 +14,9 @@ QMAKE_LFLAGS += " -lusb-1.0 "
 SOURCES += \
     main.cpp \
     mainwindow.cpp \
-    ../harpoon.c
+    ../harpoon.c \
+    ../compositor.c \
+    ../idle.c
 
 HEADERS += \
     mainwindow.h \
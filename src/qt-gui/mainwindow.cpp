@@ -2,9 +2,11 @@
 #include "ui_mainwindow.h"
 #include <QMessageBox>
 #include <QTimer>
+#include <QSocketNotifier>
 #include <math.h>
 
 #define DEFAULT_INDEX 1
+#define IDLE_TIMEOUT (5 * 60 * 1000) /* pause auto hue after this many msec without input */
 
 static void onConnect(void *udata)
 {
@@ -36,6 +38,9 @@ static void onDisconnect(void *udata)
 
     fprintf(stderr, "onDisconnect\n");
 
+    /* the next connection sends everything anyway */
+    mw->unsent = NONE;
+
     mw->ui->centralwidget->setEnabled(false);
     if (mw->ui->statusBar->currentMessage().isEmpty())
         mw->ui->statusBar->showMessage("Searching for mouse...");
@@ -43,16 +48,102 @@ static void onDisconnect(void *udata)
 
 void MainWindow::harpoonFunc(void)
 {
-    harpoon_monitor(hp);
+    harpoon_handle_events(hp, 0);
+
+    /* what the control lane had no room for, now that it has emptied */
+    if (unsent && !harpoon_pending(hp, HARPOON_PRIORITY_CONTROL))
+    {
+        enum packetType types = (enum packetType)unsent;
+
+        unsent = NONE;
+        sendPackets(types);
+        return;
+    }
+
+    watchHarpoon();
+}
+
+/* wake up only when libusb has work, instead of on a fixed timer */
+void MainWindow::watchHarpoon(void)
+{
+    QVector<struct pollfd> fds(16);
+    int timeout;
+    int n;
+
+    n = harpoon_get_pollfds(hp, fds.data(), fds.size());
+    if (n > fds.size())
+    {
+        fds.resize(n);
+        harpoon_get_pollfds(hp, fds.data(), n);
+    }
+    fds.resize(n);
+
+    /* descriptors change as the mouse is opened and closed */
+    bool same = fds.size() == pollfds.size();
+    for (int i = 0; same && i < n; ++i)
+        same = fds[i].fd == pollfds[i].fd && fds[i].events == pollfds[i].events;
+
+    if (!same)
+    {
+        for (QSocketNotifier *sn : notifiers)
+        {
+            sn->setEnabled(false);
+            sn->deleteLater();
+        }
+        notifiers.clear();
+
+        for (const struct pollfd &fd : fds)
+        {
+            QSocketNotifier::Type types[] = { QSocketNotifier::Read, QSocketNotifier::Write };
+            short events[] = { POLLIN, POLLOUT };
+
+            for (int k = 0; k < 2; ++k)
+            {
+                if (!(fd.events & events[k]))
+                    continue;
+
+                QSocketNotifier *sn = new QSocketNotifier(fd.fd, types[k], this);
+                connect(sn, SIGNAL(activated(int)), this, SLOT(harpoonFunc()));
+                notifiers.append(sn);
+            }
+        }
+        pollfds = fds;
+    }
+
+    /* plus whatever deadline libusb or the reconnect logic has */
+    timeout = harpoon_get_timeout(hp);
+    if (timeout < 0)
+        monitorTimer->stop();
+    else
+        monitorTimer->start(timeout);
 }
 
 void MainWindow::autoFunc(void)
 {
+    /* nobody is looking; stop until the next input event */
+    if (idle && harpoonIdle_check(idle))
+    {
+        autoTimer->stop();
+        idleNotifier->setEnabled(true);
+        return;
+    }
+
     int nextValue = (ui->sliderHue->value() + 1) % ui->sliderHue->maximum();
     ui->sliderHue->setValue(nextValue);
     doColor();
 }
 
+void MainWindow::idleFunc(void)
+{
+    if (harpoonIdle_check(idle))
+        return;
+
+    /* back at full rate, if the user still wants it */
+    idleNotifier->setEnabled(false);
+    if (ui->cbAuto->isChecked() && ui->spinSpeed->value())
+        autoTimer->start();
+}
+
 void MainWindow::sendPackets(enum packetType types)
 {
     struct harpoon *hp = this->hp;
@@ -68,55 +159,80 @@ void MainWindow::sendPackets(enum packetType types)
 
         ui->centralwidget->setEnabled(false);
         ui->statusBar->showMessage("Restarting mouse...");
-        harpoon_send(hp, harpoonPacket_pollrate(rates[index]));
+        harpoon_queue(hp, harpoonPacket_pollrate(rates[index]));
     }
     if (most || (types & DPICONFIG))
     {
         int precision = spinDpi_validate(ui->spinDpi->value());
 
-        harpoon_send(hp, harpoonPacket_dpiconfig(
+        /* a full lane gets the newest values once it has emptied */
+        if (harpoon_queue(hp, harpoonPacket_dpiconfig(
             DEFAULT_INDEX
             , precision /* x, y */
             , precision
             , ledColor >> 16 /* r, g, b */
             , ledColor >> 8
             , ledColor
-        ));
+        )))
+            unsent |= DPICONFIG;
     }
     if (most || (types & COLOR))
     {
-        harpoon_send(hp, harpoonPacket_color(
+        harpoon_queue(hp, harpoonPacket_color(
             ledColor >> 16 /* r, g, b */
             , ledColor >> 8
             , ledColor
         ));
     }
+
+    /* control packets go out ahead of any pending color frame;
+     * whatever is left follows from within harpoonFunc(), as does
+     * a color the filter skipped, should it be the last one
+     */
+    harpoon_flush(hp);
+    watchHarpoon();
 }
 
 MainWindow::MainWindow(QWidget *parent)
     : QMainWindow(parent)
     , ui(new Ui::MainWindow)
 {
+    unsent = NONE;
     hp = harpoon_new();
     harpoon_set_onDisconnect(hp, onDisconnect, this);
     harpoon_set_onConnect(hp, onConnect, this);
 
+    /* the hue cycle produces many frames too close to tell apart */
+    harpoon_set_colorFilter(hp, 20, 1000);
+
     ui->setupUi(this);
     doColor();
     onDisconnect(this);
 
     monitorTimer = new QTimer(this);
+    monitorTimer->setSingleShot(true);
     connect(monitorTimer, SIGNAL(timeout()), this, SLOT(harpoonFunc()));
-    monitorTimer->start(1000);
+    watchHarpoon();
 
     autoTimer = new QTimer(this);
     connect(autoTimer, SIGNAL(timeout()), this, SLOT(autoFunc()));
+
+    /* input activity, for pausing the auto hue when unattended */
+    idleNotifier = 0;
+    if ((idle = harpoonIdle_new(IDLE_TIMEOUT)))
+    {
+        idleNotifier = new QSocketNotifier(harpoonIdle_fd(idle), QSocketNotifier::Read, this);
+        idleNotifier->setEnabled(false);
+        connect(idleNotifier, SIGNAL(activated(int)), this, SLOT(idleFunc()));
+    }
 }
 
 MainWindow::~MainWindow()
 {
     monitorTimer->stop();
     harpoon_delete(hp);
+    delete idleNotifier;
+    harpoonIdle_delete(idle);
     delete ui;
 }
 
@@ -2,6 +2,7 @@
 #define MAINWINDOW_H
 
 #include <QMainWindow>
+#include <QVector>
 
 extern "C" {
 #include "../harpoon.h"
@@ -20,6 +21,7 @@ enum packetType
 
 QT_BEGIN_NAMESPACE
 namespace Ui { class MainWindow; }
+class QSocketNotifier;
 QT_END_NAMESPACE
 
 class MainWindow : public QMainWindow
@@ -30,12 +32,14 @@ protected slots:
     /* timer functions */
     void harpoonFunc(void);
     void autoFunc(void);
+    void idleFunc(void);
 
 public:
     MainWindow(QWidget *parent = nullptr);
     ~MainWindow();
     struct harpoon *hp;
     Ui::MainWindow *ui;
+    int unsent; /* packetType bits that didn't fit in the control lane */
 
     /* simple driver abstraction */
     void sendPackets(enum packetType types);
@@ -63,6 +67,12 @@ private:
 
     QTimer *autoTimer;
     QTimer *monitorTimer;
+    QVector<QSocketNotifier*> notifiers;
+    struct harpoonIdle *idle;
+    QSocketNotifier *idleNotifier;
+    QVector<struct pollfd> pollfds;
+
+    void watchHarpoon(void);
 
     int spinDpi_validate(int v);
     void doColor(void);
@@ -0,0 +1,455 @@
+/*
+ * sniper.c <z64.me>
+ *
+ * a resident "sniper button": while a key or
+ * button is held, the mouse drops to a lower
+ * precision, and goes back when it is released
+ *
+ * the packets are built once up front, so a press
+ * costs a single transfer submission; how long
+ * that took from the input event is recorded,
+ * and summarized on exit (Ctrl+C)
+ *
+ * --test presses the button through uinput, for
+ * measuring without touching anything
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <strings.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include <linux/uinput.h>
+
+#include "harpoon.h"
+
+#define INPUTS_MAX 64
+#define MAX_POLLFDS 16
+
+/* the mode reserved for sniping; its settings are overwritten */
+#define SNIPER_MODE 5
+
+/* latencies kept for the summary */
+#define SAMPLE_MAX 4096
+
+/* --test presses and releases this often */
+#define TEST_INTERVAL_MSEC 50
+
+struct sniper;
+
+struct sample
+{
+	struct sniper *owner;
+	uint64_t event;    /* input event time, nsec on the monotonic clock */
+	uint32_t submit;   /* nsec from the event until the packet was submitted */
+	uint32_t complete; /* ...until the mouse had it; 0 = never */
+};
+
+struct sniper
+{
+	struct harpoon *hp;
+	struct harpoonInput *input;
+	unsigned key;
+	
+	/* encoded once; only copied into a transfer when used */
+	harpoonPacket config[HARPOON_PACKET_SIZE];  /* sniper mode settings */
+	harpoonPacket press[HARPOON_PACKET_SIZE];   /* switch to sniper mode */
+	harpoonPacket release[HARPOON_PACKET_SIZE]; /* and back */
+	
+	/* what the mouse should be set to; 'stale' until it has been
+	 * submitted, for when every transfer was in use
+	 */
+	bool held;
+	bool stale;
+	uint64_t heldEvent;
+	
+	struct sample sample[SAMPLE_MAX];
+	unsigned long samples;
+	unsigned long failed;  /* presses and releases that had to wait */
+};
+
+static volatile sig_atomic_t quit = 0;
+
+/* fatal error message */
+static void die(const char *fmt, ...)
+{
+	va_list ap;
+	
+	if (!fmt)
+		exit(EXIT_FAILURE);
+		
+	fprintf(stderr, "[!] ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	
+	exit(EXIT_FAILURE);
+}
+
+static void showargs(void)
+{
+#define P(X) fprintf(stderr, X "\n")
+	P("  -k, --key       key or button to hold, by name or evdev code (default BTN_SIDE)");
+	P("  -d, --dpi       precision while held; multiple of 250 (default 500)");
+	P("  -m, --mode      DPI mode 0 - 4 to return to on release (default 1)");
+	P("  -c, --color     LED color while held (default 0xff0000)");
+	P("  -i, --input     listen only to this event device; may be repeated");
+	P("  -t, --test      press the key this many times through uinput, then exit");
+#undef P
+	exit(EXIT_FAILURE);
+}
+
+static void onSignal(int sig)
+{
+	(void)sig;
+	
+	quit = 1;
+}
+
+/* nanoseconds on the monotonic clock */
+static uint64_t now_nsec(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* evdev code from a name or a number; -1 if unknown */
+static int get_key(const char *str)
+{
+	static const struct { const char *name; int code; } names[] =
+	{
+		{ "BTN_LEFT", BTN_LEFT }
+		, { "BTN_RIGHT", BTN_RIGHT }
+		, { "BTN_MIDDLE", BTN_MIDDLE }
+		, { "BTN_SIDE", BTN_SIDE }
+		, { "BTN_EXTRA", BTN_EXTRA }
+		, { "BTN_FORWARD", BTN_FORWARD }
+		, { "BTN_BACK", BTN_BACK }
+		, { "KEY_LEFTSHIFT", KEY_LEFTSHIFT }
+		, { "KEY_LEFTCTRL", KEY_LEFTCTRL }
+		, { "KEY_LEFTALT", KEY_LEFTALT }
+		, { "KEY_CAPSLOCK", KEY_CAPSLOCK }
+	};
+	char *end;
+	long code;
+	unsigned i;
+	
+	for (i = 0; i < sizeof(names) / sizeof(*names); ++i)
+		if (!strcasecmp(str, names[i].name))
+			return names[i].code;
+			
+	code = strtol(str, &end, 0);
+	
+	return *end || code <= 0 || code > KEY_MAX ? -1 : code;
+}
+
+static void onSent(void *udata, int result);
+	
+/* tell the mouse whether the key is held; if every transfer
+ * is in use, the next one to complete tries again
+ */
+static void sniper_send(struct sniper *s)
+{
+	struct sample *sample = &s->sample[s->samples % SAMPLE_MAX];
+	
+	if (!harpoon_isConnected(s->hp))
+		return;
+		
+	sample->owner = s;
+	sample->event = s->heldEvent;
+	sample->complete = 0;
+	if (harpoon_sendAsync(s->hp, s->held ? s->press : s->release, onSent, sample))
+	{
+		if (!s->stale)
+			s->failed += 1;
+		s->stale = true;
+		return;
+	}
+	s->stale = false;
+	sample->submit = now_nsec() - sample->event;
+	s->samples += 1;
+}
+
+static void onSent(void *udata, int result)
+{
+	struct sample *sample = udata;
+	struct sniper *s = sample->owner;
+	
+	if (!result)
+		sample->complete = now_nsec() - sample->event;
+		
+	/* a transfer just came free */
+	if (s->stale)
+		sniper_send(s);
+}
+
+/* the key went down (1) or up (0); autorepeat is ignored */
+static void sniper_key(struct sniper *s, int value, uint64_t event)
+{
+	s->held = value;
+	s->heldEvent = event;
+	sniper_send(s);
+}
+
+/* an event from any of the input devices */
+static void sniper_onEvent(void *udata, unsigned type, unsigned code, int value, uint64_t nsec)
+{
+	struct sniper *s = udata;
+	
+	if (type != EV_KEY || code != s->key || value > 1)
+		return;
+		
+	sniper_key(s, value, nsec);
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	
+	return (x > y) - (x < y);
+}
+
+/* print one latency distribution, in usec */
+static void summarize(const char *what, uint32_t *v, unsigned long n)
+{
+	if (!n)
+		return;
+		
+	qsort(v, n, sizeof(*v), compare_u32);
+	fprintf(stderr, "  %-10s p50 %8.1f  p99 %8.1f  max %8.1f us\n"
+		, what
+		, v[(unsigned long)(0.50 * (n - 1) + 0.5)] / 1000.0
+		, v[(unsigned long)(0.99 * (n - 1) + 0.5)] / 1000.0
+		, v[n - 1] / 1000.0
+	);
+}
+
+static void sniper_report(struct sniper *s)
+{
+	static uint32_t submit[SAMPLE_MAX];
+	static uint32_t complete[SAMPLE_MAX];
+	unsigned long n = s->samples < SAMPLE_MAX ? s->samples : SAMPLE_MAX;
+	unsigned long done = 0;
+	unsigned long i;
+	
+	for (i = 0; i < n; ++i)
+	{
+		submit[i] = s->sample[i].submit;
+		if (s->sample[i].complete)
+			complete[done++] = s->sample[i].complete;
+	}
+	
+	fprintf(stderr, "%lu press/release event(s), %lu waited for a transfer\n", s->samples, s->failed);
+	summarize("submitted", submit, n);
+	summarize("completed", complete, done);
+}
+
+static void onConnect(void *udata)
+{
+	struct sniper *s = udata;
+	
+	fprintf(stderr, "onConnect\n");
+	
+	/* the mouse may have restarted; set the sniper mode up again */
+	harpoon_send(s->hp, s->config);
+	harpoon_send(s->hp, s->held ? s->press : s->release);
+	s->stale = false;
+}
+
+static void onDisconnect(void *udata)
+{
+	fprintf(stderr, "onDisconnect\n");
+	
+	(void)udata;
+}
+
+/* a virtual device with only the key on it */
+static int test_create(unsigned key)
+{
+	struct uinput_setup setup = {0};
+	int fd;
+	
+	if ((fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+		die("failed to open /dev/uinput: %s", strerror(errno));
+		
+	setup.id.bustype = BUS_VIRTUAL;
+	snprintf(setup.name, sizeof(setup.name), "harpoon-sniper test");
+	if (ioctl(fd, UI_SET_EVBIT, EV_KEY)
+		|| ioctl(fd, UI_SET_KEYBIT, key)
+		|| ioctl(fd, UI_DEV_SETUP, &setup)
+		|| ioctl(fd, UI_DEV_CREATE)
+	)
+		die("failed to create a uinput device: %s", strerror(errno));
+		
+	return fd;
+}
+
+static void test_emit(int fd, unsigned key, int value)
+{
+	struct input_event ev[2] = {0};
+	
+	ev[0].type = EV_KEY;
+	ev[0].code = key;
+	ev[0].value = value;
+	ev[1].type = EV_SYN;
+	ev[1].code = SYN_REPORT;
+	if (write(fd, ev, sizeof(ev)) != sizeof(ev))
+		die("failed to write to the uinput device");
+}
+
+int main(int argc, char *argv[])
+{
+	static struct sniper s;
+	const char *inputs[INPUTS_MAX];
+	const char *errstr;
+	unsigned int color = 0xff0000;
+	int precision = 500;
+	int mode = 1;
+	int key = BTN_SIDE;
+	int test = 0;
+	int testFd = -1;
+	int testSent = 0;
+	uint64_t testNext = 0;
+	int ninputs = 0;
+	int i;
+	
+	/* step through arguments */
+	for (i = 1; i < argc; i += 2)
+	{
+#define ARGMATCH(ALIAS, NAME) (!strcasecmp(this, "-" ALIAS) \
+	|| !strcasecmp(this, "--" NAME))
+		const char *this = argv[i];
+		const char *param = argv[i + 1];
+		
+		if (!param)
+			showargs();
+			
+		if (ARGMATCH("k", "key"))
+		{
+			if ((key = get_key(param)) < 0)
+				die("unknown key '%s'", param);
+		}
+		else if (ARGMATCH("d", "dpi"))
+			precision = strtol(param, 0, 0);
+		else if (ARGMATCH("m", "mode"))
+			mode = strtol(param, 0, 0);
+		else if (ARGMATCH("c", "color"))
+			color = strtoul(param, 0, 16);
+		else if (ARGMATCH("i", "input") && ninputs < INPUTS_MAX)
+			inputs[ninputs++] = param;
+		else if (ARGMATCH("t", "test"))
+			test = strtol(param, 0, 0);
+		else
+			showargs();
+#undef ARGMATCH
+	}
+	if (precision < 250 || precision > 6000 || precision % 250)
+		die("invalid precision; expecting multiple of 250, between 250 and 6000");
+	if (mode < 0 || mode >= SNIPER_MODE)
+		die("invalid mode; expecting 0 - %d", SNIPER_MODE - 1);
+	if (color > 0xffffff || test < 0)
+		die("invalid arguments");
+	if (test && ninputs)
+		die("--test listens to every device; leave out --input");
+		
+	s.key = key;
+	memcpy(s.config, harpoonPacket_dpiconfig(
+		SNIPER_MODE
+		, precision /* x, y */
+		, precision
+		, color >> 16 /* r, g, b */
+		, color >> 8
+		, color
+	), HARPOON_PACKET_SIZE);
+	memcpy(s.press, harpoonPacket_dpimode(SNIPER_MODE), HARPOON_PACKET_SIZE);
+	memcpy(s.release, harpoonPacket_dpimode(mode), HARPOON_PACKET_SIZE);
+	
+	if (!(s.input = harpoonInput_new()))
+		die("failed to create an epoll instance");
+		
+	/* named devices, or every device with the key, now and later */
+	for (i = 0; i < ninputs; ++i)
+		if (harpoonInput_open(s.input, inputs[i]))
+			die("failed to open '%s': %s", inputs[i], strerror(errno));
+	if (!ninputs && harpoonInput_scan(s.input, key))
+		die("failed to watch for input devices: %s", strerror(errno));
+	if (test)
+	{
+		testFd = test_create(key);
+		testNext = now_nsec() + 500 * 1000000ull; /* for udev to catch up */
+	}
+		
+	s.hp = harpoon_new();
+	harpoon_set_onDisconnect(s.hp, onDisconnect, &s);
+	harpoon_set_onConnect(s.hp, onConnect, &s);
+	if ((errstr = harpoon_connect(s.hp)))
+		fprintf(stderr, "%s; waiting for the mouse\n", errstr);
+		
+	signal(SIGINT, onSignal);
+	signal(SIGTERM, onSignal);
+	
+	while (!quit)
+	{
+		struct pollfd fds[1 + MAX_POLLFDS];
+		int timeout = harpoon_get_timeout(s.hp);
+		int n;
+		
+		/* input devices wait behind one descriptor */
+		fds[0].fd = harpoonInput_fd(s.input);
+		fds[0].events = POLLIN;
+		n = harpoon_get_pollfds(s.hp, fds + 1, MAX_POLLFDS);
+		if (n > MAX_POLLFDS)
+			n = MAX_POLLFDS;
+			
+		if (test)
+		{
+			uint64_t now = now_nsec();
+			int wait = now < testNext ? (testNext - now) / 1000000 : 0;
+			
+			if (timeout < 0 || wait < timeout)
+				timeout = wait;
+		}
+		
+		poll(fds, 1 + n, timeout);
+		
+		/* input first; it is what someone is waiting on */
+		if (fds[0].revents & POLLIN)
+			harpoonInput_read(s.input, sniper_onEvent, &s);
+		harpoon_handle_events(s.hp, 0);
+		
+		if (test && now_nsec() >= testNext)
+		{
+			if (testSent == test * 2)
+				break;
+			test_emit(testFd, key, !(testSent & 1));
+			testSent += 1;
+			testNext = now_nsec() + TEST_INTERVAL_MSEC * 1000000ull;
+		}
+	}
+	
+	sniper_report(&s);
+	
+	if (testFd >= 0)
+	{
+		ioctl(testFd, UI_DEV_DESTROY);
+		close(testFd);
+	}
+	harpoon_delete(s.hp);
+	harpoonInput_delete(s.input);
+	
+	return 0;
+}
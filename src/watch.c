@@ -0,0 +1,497 @@
+/*
+ * watch.c <z64.me>
+ *
+ * a resident program that applies a config
+ * file to the mouse, and re-applies only
+ * what changed whenever the file is saved
+ *
+ * config file format, one setting per line:
+ *   polling 1000              (Hertz: 1000, 500, 250, 125)
+ *   dpi 4 1000 0xff0000       (index precision 0xHexColor)
+ *   simple 1000 0xff0000      (precision 0xHexColor, for all modes)
+ *   only 012345               (DPI modes the button may cycle through)
+ *   color 0x00ff00            (LED color)
+ *   # comment
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+#include "harpoon.h"
+
+#define DPIMODE_COUNT 6
+
+#define MAX_POLLFDS 16
+
+struct dpimode
+{
+	int precision;
+	unsigned int color;
+};
+
+/* everything a config file can describe; zero means unset */
+struct config
+{
+	int polling;
+	struct dpimode dpimode[DPIMODE_COUNT];
+	bool hasOnly;
+	bool enabled[DPIMODE_COUNT];
+	bool hasColor;
+	unsigned int color;
+};
+
+struct watch
+{
+	struct harpoon *hp;
+	const char *path;
+	struct config wanted;  /* most recent valid file contents */
+	struct config queued;  /* what the mouse has once the lanes empty */
+	struct config applied; /* what went out while it stayed connected */
+	int applying;          /* packets of the last change still going out */
+	bool unsent;           /* part of it didn't fit in the control lane */
+	int polling;           /* poll rate waiting for the lanes to empty */
+	int pollingSent;       /* poll rate on its way to the mouse */
+	double applyStart;     /* when the file changed */
+};
+
+/* fatal error message */
+static void die(const char *fmt, ...)
+{
+	va_list ap;
+	
+	if (!fmt)
+		exit(EXIT_FAILURE);
+		
+	fprintf(stderr, "[!] ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	
+	exit(EXIT_FAILURE);
+}
+
+/* milliseconds on the monotonic clock */
+static double now_msec(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* retrieve and validate color */
+static bool get_color(const char *str, unsigned int *color)
+{
+	return str
+		&& sscanf(str, "%x", color) == 1
+		&& *color <= 0xffffff
+	;
+}
+
+/* retrieve and validate precision */
+static bool get_precision(const char *str, int *precision)
+{
+	return str
+		&& sscanf(str, "%d", precision) == 1
+		&& *precision >= 250
+		&& *precision <= 6000
+		&& !(*precision % 250)
+	;
+}
+
+/* parse one line of the config file; returns error string on failure */
+static const char *config_parseLine(struct config *cfg, char *line)
+{
+	const char *sep = " \t\r\n";
+	const char *cmd = strtok(line, sep);
+	const char *a = strtok(0, sep);
+	const char *b = strtok(0, sep);
+	const char *c = strtok(0, sep);
+	int k;
+	
+	/* blank lines and comments */
+	if (!cmd || *cmd == '#')
+		return 0;
+		
+	if (!strcasecmp(cmd, "polling"))
+	{
+		if (!a || sscanf(a, "%d", &cfg->polling) != 1
+			|| (cfg->polling != 1000
+				&& cfg->polling != 500
+				&& cfg->polling != 250
+				&& cfg->polling != 125
+			)
+		)
+			return "invalid polling rate; valid options: 1000, 500, 250, 125";
+	}
+	else if (!strcasecmp(cmd, "dpi"))
+	{
+		struct dpimode mode;
+		int index;
+		
+		if (!a || sscanf(a, "%d", &index) != 1
+			|| index < 0
+			|| index >= DPIMODE_COUNT
+		)
+			return "invalid dpi index; expecting 0 - 5";
+			
+		if (!get_precision(b, &mode.precision))
+			return "invalid precision; expecting multiple of 250, between 250 and 6000";
+			
+		if (!get_color(c, &mode.color))
+			return "invalid color; hex value must be < 0xffffff";
+			
+		cfg->dpimode[index] = mode;
+	}
+	else if (!strcasecmp(cmd, "simple"))
+	{
+		struct dpimode mode;
+		
+		if (!get_precision(a, &mode.precision))
+			return "invalid precision; expecting multiple of 250, between 250 and 6000";
+			
+		if (!get_color(b, &mode.color))
+			return "invalid color; hex value must be < 0xffffff";
+			
+		for (k = 0; k < DPIMODE_COUNT; ++k)
+			cfg->dpimode[k] = mode;
+	}
+	else if (!strcasecmp(cmd, "only"))
+	{
+		const char *s;
+		
+		if (!a)
+			return "missing mode list";
+			
+		memset(cfg->enabled, 0, sizeof(cfg->enabled));
+		for (s = a; *s; ++s)
+		{
+			if (*s < '0' || *s >= '0' + DPIMODE_COUNT)
+				return "invalid mode list, expecting only decimal values 0 - 5";
+				
+			cfg->enabled[*s - '0'] = true;
+		}
+		cfg->hasOnly = true;
+	}
+	else if (!strcasecmp(cmd, "color"))
+	{
+		if (!get_color(a, &cfg->color))
+			return "invalid color; hex value must be < 0xffffff";
+			
+		cfg->hasColor = true;
+	}
+	else
+		return "unknown setting";
+		
+	return 0;
+}
+
+/* parse a whole config file; the result is only written on success */
+static bool config_load(struct config *dst, const char *path)
+{
+	struct config cfg = {0};
+	char line[256];
+	FILE *fp;
+	int lineno = 0;
+	bool ok = true;
+	
+	if (!(fp = fopen(path, "r")))
+	{
+		fprintf(stderr, "[!] failed to open '%s': %s\n", path, strerror(errno));
+		return false;
+	}
+	
+	while (fgets(line, sizeof(line), fp))
+	{
+		const char *errstr;
+		
+		lineno += 1;
+		if ((errstr = config_parseLine(&cfg, line)))
+		{
+			fprintf(stderr, "[!] %s:%d: %s\n", path, lineno, errstr);
+			ok = false;
+			break;
+		}
+	}
+	
+	fclose(fp);
+	
+	if (ok)
+		*dst = cfg;
+		
+	return ok;
+}
+
+/* send the packets that turn 'queued' into 'wanted'; returns packet count;
+ * whatever the control lane has no room for stays different, and is sent
+ * by the next call, once the lane has emptied
+ */
+static int watch_apply(struct watch *w)
+{
+	struct config *want = &w->wanted;
+	struct config *have = &w->queued;
+	struct harpoon *hp = w->hp;
+	int count = 0;
+	int i;
+	
+	w->unsent = false;
+	if (!harpoon_isConnected(hp))
+		return 0;
+		
+	for (i = 0; i < DPIMODE_COUNT; ++i)
+	{
+		struct dpimode *mode = &want->dpimode[i];
+		
+		if (!mode->precision
+			|| !memcmp(mode, &have->dpimode[i], sizeof(*mode))
+		)
+			continue;
+			
+		if (harpoon_queue(hp, harpoonPacket_dpiconfig(
+				i
+				, mode->precision /* x, y */
+				, mode->precision
+				, mode->color >> 16 /* r, g, b */
+				, mode->color >> 8
+				, mode->color
+			))
+			|| harpoon_queue(hp, harpoonPacket_dpimode(i)) /* use new mode */
+		)
+			goto full;
+		have->dpimode[i] = *mode;
+		count += 2;
+	}
+	
+	if (want->hasOnly
+		&& (!have->hasOnly
+			|| memcmp(want->enabled, have->enabled, sizeof(want->enabled))
+		)
+	)
+	{
+		if (harpoon_queue(hp, harpoonPacket_dpisetenabled(
+			want->enabled[0]
+			, want->enabled[1]
+			, want->enabled[2]
+			, want->enabled[3]
+			, want->enabled[4]
+			, want->enabled[5]
+		)))
+			goto full;
+		have->hasOnly = true;
+		memcpy(have->enabled, want->enabled, sizeof(have->enabled));
+		count += 1;
+	}
+	
+	if (want->hasColor
+		&& (!have->hasColor || want->color != have->color)
+	)
+	{
+		harpoon_queue(hp, harpoonPacket_color(
+			want->color >> 16 /* r, g, b */
+			, want->color >> 8
+			, want->color
+		));
+		have->hasColor = true;
+		have->color = want->color;
+		count += 1;
+	}
+	
+	/* the mouse restarts after this one, so watch_settle() sends it
+	 * after everything else; only when the rate itself has changed
+	 */
+	if (want->polling && want->polling != have->polling)
+	{
+		w->polling = want->polling;
+		have->polling = want->polling;
+		count += 1;
+	}
+	
+	harpoon_flush(hp);
+	
+	return count;
+	
+full:
+	/* the rest waits, poll rate included, so the restart stays last */
+	w->unsent = true;
+	harpoon_flush(hp);
+	
+	return count;
+}
+
+/* the poll rate is only known to have changed once it has gone out;
+ * the restart that follows runs right after this, from within the
+ * same harpoon_handle_events()
+ */
+static void onPolled(void *udata, int result)
+{
+	struct watch *w = udata;
+	
+	/* a rate that didn't go out differs again, for the next change */
+	if (!result)
+		w->applied.polling = w->pollingSent;
+	else
+		w->queued.polling = w->applied.polling;
+	w->pollingSent = 0;
+}
+
+/* the lanes have emptied with the mouse still connected, so what was
+ * queued went out; a poll rate change follows, sent on its own so its
+ * result is known, as nothing may follow it to the old session
+ */
+static void watch_settle(struct watch *w)
+{
+	int polling = w->applied.polling;
+	
+	w->applied = w->queued;
+	w->applied.polling = polling;
+	
+	if (w->polling && !w->unsent && !w->pollingSent
+		&& !harpoon_sendAsync(w->hp, harpoonPacket_pollrate(1000 / w->polling), onPolled, w)
+	)
+	{
+		w->pollingSent = w->polling;
+		w->polling = 0;
+	}
+}
+
+static void onConnect(void *udata)
+{
+	struct watch *w = udata;
+	int polling = w->applied.polling;
+	
+	fprintf(stderr, "onConnect\n");
+	
+	/* the mouse may have restarted; everything but a polling rate
+	 * that went out must be repropagated
+	 */
+	memset(&w->applied, 0, sizeof(w->applied));
+	w->applied.polling = polling;
+	w->queued = w->applied;
+	w->polling = 0;
+	w->pollingSent = 0;
+	if ((w->applying = watch_apply(w)))
+		w->applyStart = now_msec();
+}
+
+static void onDisconnect(void *udata)
+{
+	fprintf(stderr, "onDisconnect\n");
+	
+	(void)udata;
+}
+
+int main(int argc, char *argv[])
+{
+	struct watch w = {0};
+	char *dirbuf;
+	char *basebuf;
+	const char *base;
+	int fd;
+	
+	if (argc != 2)
+	{
+		fprintf(stderr, "usage: %s harpoon.conf\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	w.path = argv[1];
+	
+	if (!config_load(&w.wanted, w.path))
+		return EXIT_FAILURE;
+		
+	/* watch the directory, because editors often save by renaming */
+	if (!(dirbuf = strdup(w.path)) || !(basebuf = strdup(w.path)))
+		die("memory error");
+	base = basename(basebuf);
+	if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0
+		|| inotify_add_watch(fd, dirname(dirbuf), IN_CLOSE_WRITE | IN_MOVED_TO) < 0
+	)
+		die("failed to watch '%s': %s", w.path, strerror(errno));
+		
+	w.hp = harpoon_new();
+	harpoon_set_onDisconnect(w.hp, onDisconnect, &w);
+	harpoon_set_onConnect(w.hp, onConnect, &w);
+	
+	while (1)
+	{
+		struct pollfd fds[1 + MAX_POLLFDS];
+		char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+		bool changed = false;
+		ssize_t len;
+		char *p;
+		double start;
+		int count;
+		int n;
+		
+		/* the config file, and whatever libusb is waiting on */
+		fds[0].fd = fd;
+		fds[0].events = POLLIN;
+		n = harpoon_get_pollfds(w.hp, fds + 1, MAX_POLLFDS);
+		if (n > MAX_POLLFDS)
+			n = MAX_POLLFDS;
+			
+		poll(fds, 1 + n, harpoon_get_timeout(w.hp));
+		start = now_msec();
+		harpoon_handle_events(w.hp, 0);
+		
+		/* the rest of a change, now that the control lane has room */
+		if (w.unsent && !harpoon_pending(w.hp, HARPOON_PRIORITY_CONTROL))
+			w.applying += watch_apply(&w);
+			
+		/* packets go out from within harpoon_handle_events() */
+		if (harpoon_isConnected(w.hp)
+			&& !harpoon_pending(w.hp, HARPOON_PRIORITY_CONTROL)
+			&& !harpoon_pending(w.hp, HARPOON_PRIORITY_COSMETIC)
+		)
+		{
+			watch_settle(&w);
+			
+			if (w.applying && !w.polling && !w.pollingSent)
+			{
+				fprintf(stderr, "applied %d packet(s) in %.3f ms\n", w.applying, now_msec() - w.applyStart);
+				w.applying = 0;
+			}
+		}
+		
+		if (!(fds[0].revents & POLLIN))
+			continue;
+			
+		while ((len = read(fd, buf, sizeof(buf))) > 0)
+		{
+			for (p = buf; p < buf + len; )
+			{
+				const struct inotify_event *ev = (void*)p;
+				
+				if (ev->len && !strcmp(ev->name, base))
+					changed = true;
+					
+				p += sizeof(*ev) + ev->len;
+			}
+		}
+		
+		if (!changed || !config_load(&w.wanted, w.path))
+			continue;
+			
+		if ((count = watch_apply(&w)))
+		{
+			w.applying = count;
+			w.applyStart = start;
+		}
+	}
+	
+	harpoon_delete(w.hp);
+	
+	return 0;
+}